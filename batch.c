@@ -0,0 +1,191 @@
+#include "batch.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+int batch_init(ddhcp_recv_batch* batch) {
+  DEBUG("batch_init(batch)\n");
+  memset(batch, 0, sizeof(ddhcp_recv_batch));
+  batch->buffers = (uint8_t*) malloc(BATCH_SIZE * BATCH_BUFFER_LEN);
+
+  if (batch->buffers == NULL) {
+    return 1;
+  }
+
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    batch->iovecs[i].iov_base = batch_buffer(batch, i);
+    batch->iovecs[i].iov_len = BATCH_BUFFER_LEN;
+    batch->msgs[i].msg_hdr.msg_iov = batch->iovecs + i;
+    batch->msgs[i].msg_hdr.msg_iovlen = 1;
+    batch->msgs[i].msg_hdr.msg_name = batch->addrs + i;
+  }
+
+  return 0;
+}
+
+void batch_free(ddhcp_recv_batch* batch) {
+  DEBUG("batch_free(batch)\n");
+  free(batch->buffers);
+  batch->buffers = NULL;
+}
+
+int batch_recv(int socket, ddhcp_recv_batch* batch, ddhcp_batch_stats* stats) {
+  // The kernel overwrites the address length of every filled slot.
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    batch->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+  }
+
+  int count = recvmmsg(socket, batch->msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+  if (count < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("recvmmsg");
+    }
+
+    return 0;
+  }
+
+  if (count > 0) {
+    stats->batches++;
+    stats->packets += count;
+
+    if (count == BATCH_SIZE) {
+      stats->full++;
+    }
+
+    if ((uint32_t) count > stats->largest) {
+      stats->largest = count;
+    }
+  }
+
+  DEBUG("batch_recv(%i, batch, stats) -> %i datagrams\n", socket, count);
+
+  return count;
+}
+
+void batch_show_status(int fd, const char* name, ddhcp_batch_stats* stats) {
+  dprintf(fd, "%s receive\n", name);
+  dprintf(fd, "      batches/packets\t%lu/%lu\n", (unsigned long) stats->batches, (unsigned long) stats->packets);
+  dprintf(fd, "      full batches\t%lu\n", (unsigned long) stats->full);
+  dprintf(fd, "      largest batch\t%u\n", stats->largest);
+}
+
+int batch_queue_init(ddhcp_send_queue* queue, int socket) {
+  DEBUG("batch_queue_init(queue, %i)\n", socket);
+  memset(queue, 0, sizeof(ddhcp_send_queue));
+  queue->socket = socket;
+  queue->buffers = (uint8_t*) malloc(SEND_QUEUE_SIZE * SEND_BUFFER_LEN);
+
+  if (queue->buffers == NULL) {
+    return 1;
+  }
+
+  for (int i = 0; i < SEND_QUEUE_SIZE; i++) {
+    queue->iovecs[i].iov_base = queue->buffers + i * SEND_BUFFER_LEN;
+    queue->msgs[i].msg_hdr.msg_iov = queue->iovecs + i;
+    queue->msgs[i].msg_hdr.msg_iovlen = 1;
+    queue->msgs[i].msg_hdr.msg_name = queue->addrs + i;
+  }
+
+  return 0;
+}
+
+void batch_queue_free(ddhcp_send_queue* queue) {
+  DEBUG("batch_queue_free(queue)\n");
+  free(queue->buffers);
+  queue->buffers = NULL;
+  queue->first = queue->count = 0;
+}
+
+void _batch_queue_compact(ddhcp_send_queue* queue) {
+  uint32_t waiting = queue->count - queue->first;
+
+  for (uint32_t i = 0; i < waiting; i++) {
+    uint32_t from = queue->first + i;
+    memcpy(queue->iovecs[i].iov_base, queue->iovecs[from].iov_base, queue->iovecs[from].iov_len);
+    queue->iovecs[i].iov_len = queue->iovecs[from].iov_len;
+    memcpy(queue->addrs + i, queue->addrs + from, queue->msgs[from].msg_hdr.msg_namelen);
+    queue->msgs[i].msg_hdr.msg_namelen = queue->msgs[from].msg_hdr.msg_namelen;
+  }
+
+  queue->first = 0;
+  queue->count = waiting;
+}
+
+uint8_t* batch_queue_push(ddhcp_send_queue* queue, int len, struct sockaddr* addr, socklen_t addr_len) {
+  if (len <= 0 || len > SEND_BUFFER_LEN || addr_len > sizeof(struct sockaddr_storage)) {
+    WARNING("batch_queue_push(queue, %i, addr, %u) -> datagram does not fit\n", len, (unsigned) addr_len);
+    queue->dropped++;
+    return NULL;
+  }
+
+  if (queue->count == SEND_QUEUE_SIZE && !queue->blocked) {
+    batch_queue_flush(queue);
+  }
+
+  if (queue->count == SEND_QUEUE_SIZE && queue->first > 0) {
+    _batch_queue_compact(queue);
+  }
+
+  if (queue->count == SEND_QUEUE_SIZE) {
+    WARNING("batch_queue_push( ... ) -> queue of socket %i overflows\n", queue->socket);
+    queue->dropped++;
+    return NULL;
+  }
+
+  uint32_t i = queue->count++;
+  queue->iovecs[i].iov_len = len;
+  memcpy(queue->addrs + i, addr, addr_len);
+  queue->msgs[i].msg_hdr.msg_namelen = addr_len;
+  queue->queued++;
+
+  return queue->iovecs[i].iov_base;
+}
+
+int batch_queue_flush(ddhcp_send_queue* queue) {
+  queue->blocked = 0;
+
+  while (queue->first < queue->count) {
+    int sent = sendmmsg(queue->socket, queue->msgs + queue->first, queue->count - queue->first, MSG_DONTWAIT);
+    queue->calls++;
+
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        DEBUG("batch_queue_flush( ... ) -> socket %i blocked, %u datagrams waiting\n", queue->socket, queue->count - queue->first);
+        queue->blocked = 1;
+        queue->stalls++;
+        break;
+      }
+
+      // The first datagram has been rejected, drop it and go on with the rest.
+      perror("sendmmsg");
+      queue->dropped++;
+      queue->first++;
+      continue;
+    }
+
+    queue->sent += sent;
+    queue->first += sent;
+  }
+
+  if (queue->first == queue->count) {
+    queue->first = queue->count = 0;
+  }
+
+  return queue->count - queue->first;
+}
+
+void batch_queue_show_status(int fd, const char* name, ddhcp_send_queue* queue) {
+  dprintf(fd, "%s send\n", name);
+  dprintf(fd, "      queued/sent/dropped\t%lu/%lu/%lu\n", (unsigned long) queue->queued, (unsigned long) queue->sent, (unsigned long) queue->dropped);
+  dprintf(fd, "      waiting\t%u\n", queue->count - queue->first);
+  dprintf(fd, "      sendmmsg calls/stalls\t%lu/%lu\n", (unsigned long) queue->calls, (unsigned long) queue->stalls);
+}
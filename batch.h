@@ -0,0 +1,79 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "types.h"
+
+/**
+ * Batched receive of datagrams.
+ *
+ * A batch holds BATCH_SIZE preallocated buffers and address slots, filled
+ * by a single recvmmsg call. Datagrams of a batch stay valid until the next
+ * call of batch_recv on the same batch.
+ */
+
+/**
+ * Allocate the buffers of a batch.
+ * Returns a value greater 0 if we are out of memory.
+ */
+int batch_init(ddhcp_recv_batch* batch);
+
+/**
+ * Free the buffers of a batch.
+ */
+void batch_free(ddhcp_recv_batch* batch);
+
+/**
+ * Receive up to BATCH_SIZE datagrams from a non blocking socket and count
+ * them in stats. Returns the number of datagrams received, a value smaller
+ * than BATCH_SIZE means the socket has been drained.
+ */
+int batch_recv(int socket, ddhcp_recv_batch* batch, ddhcp_batch_stats* stats);
+
+#define batch_buffer(batch,i) ((batch)->buffers + (i) * BATCH_BUFFER_LEN)
+#define batch_len(batch,i) ((int) (batch)->msgs[i].msg_len)
+#define batch_sender(batch,i) ((batch)->addrs[i])
+
+/**
+ * Print the statistics of a socket into given file descriptor.
+ */
+void batch_show_status(int fd, const char* name, ddhcp_batch_stats* stats);
+
+/**
+ * Batched transmit of datagrams.
+ *
+ * Datagrams are collected in a queue per socket during one iteration of the
+ * event loop and sent by batch_queue_flush with sendmmsg. While the socket
+ * buffer is full the queue is marked blocked and keeps its datagrams until
+ * the socket becomes writable again. Datagrams are only dropped when the
+ * queue overflows or the kernel rejects them.
+ */
+
+/**
+ * Prepare an empty queue for socket.
+ * Returns a value greater 0 if we are out of memory.
+ */
+int batch_queue_init(ddhcp_send_queue* queue, int socket);
+
+/**
+ * Free the buffers of a queue, queued datagrams are discarded.
+ */
+void batch_queue_free(ddhcp_send_queue* queue);
+
+/**
+ * Append a datagram of len bytes to addr and return the buffer to write it
+ * into. Returns null and counts the datagram as dropped if it does not fit.
+ */
+uint8_t* batch_queue_push(ddhcp_send_queue* queue, int len, struct sockaddr* addr, socklen_t addr_len);
+
+/**
+ * Send the queued datagrams. Returns the number of datagrams still waiting
+ * because the socket buffer is full.
+ */
+int batch_queue_flush(ddhcp_send_queue* queue);
+
+/**
+ * Print the statistics of a queue into given file descriptor.
+ */
+void batch_queue_show_status(int fd, const char* name, ddhcp_send_queue* queue);
+
+#endif
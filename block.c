@@ -1,151 +1,506 @@
 #include "block.h"
 
+#include <assert.h>
 #include <math.h>
 
+#include "client.h"
+#include "clock.h"
 #include "dhcp.h"
 #include "logger.h"
+#include "peer.h"
+#include "scan.h"
+#include "slab.h"
+#include "timer.h"
+#include "tools.h"
 
-int block_alloc(ddhcp_block* block) {
-  DEBUG("block_alloc(block)\n");
-  block->addresses = (struct dhcp_lease*) calloc(sizeof(struct dhcp_lease), block->subnet_len);
+#define BLOCK_INDEX_BITS 64
+
+void _block_index_add(uint32_t word, int32_t delta, ddhcp_config* config) {
+  for (uint32_t i = word + 1; i <= config->block_used_words; i += i & -i) {
+    config->block_used_tree[i] += delta;
+  }
+}
+
+int block_index_init(ddhcp_config* config) {
+  DEBUG("block_index_init(config)\n");
+  uint32_t words = (config->number_of_blocks + BLOCK_INDEX_BITS - 1) / BLOCK_INDEX_BITS;
+
+  config->block_used = (uint64_t*) calloc(sizeof(uint64_t), words);
+  config->block_used_tree = (uint32_t*) calloc(sizeof(uint32_t), words + 1);
+
+  if (config->block_used == NULL || config->block_used_tree == NULL) {
+    block_index_free(config);
+    return 1;
+  }
+
+  config->block_used_words = words;
+  config->num_free_blocks = config->number_of_blocks;
+
+  // Bits behind the last block are marked as used, so every word of the
+  // bitmap covers exactly BLOCK_INDEX_BITS blocks.
+  uint32_t tail = config->number_of_blocks % BLOCK_INDEX_BITS;
+
+  if (tail > 0) {
+    config->block_used[words - 1] = ~0ULL << tail;
+    _block_index_add(words - 1, BLOCK_INDEX_BITS - tail, config);
+  }
+
+  return 0;
+}
+
+void block_index_free(ddhcp_config* config) {
+  free(config->block_used);
+  free(config->block_used_tree);
+  config->block_used = NULL;
+  config->block_used_tree = NULL;
+  config->block_used_words = 0;
+  config->num_free_blocks = 0;
+}
+
+void _block_index_mark(uint32_t index, int used, ddhcp_config* config) {
+  uint32_t word = index / BLOCK_INDEX_BITS;
+  uint64_t bit = 1ULL << (index % BLOCK_INDEX_BITS);
+  int32_t delta = used ? 1 : -1;
+
+  if (!(config->block_used[word] & bit) == !used) {
+    return;
+  }
+
+  config->block_used[word] ^= bit;
+  config->num_free_blocks -= delta;
+  _block_index_add(word, delta, config);
+}
+
+/**
+ * Return the position of the k-th (counting from zero) set bit in word.
+ */
+uint32_t _block_index_select_bit(uint64_t word, uint32_t k) {
+  uint32_t pos = 0;
+
+  for (uint32_t width = BLOCK_INDEX_BITS / 2; width > 0; width >>= 1) {
+    uint32_t low = __builtin_popcountll(word & ((1ULL << width) - 1));
+
+    if (k >= low) {
+      k -= low;
+      word >>= width;
+      pos += width;
+    }
+  }
+
+  return pos;
+}
+
+/**
+ * Return the index of the k-th (counting from zero) free block.
+ * The caller has to ensure that k is less than num_free_blocks.
+ */
+uint32_t _block_index_select_free(uint32_t k, ddhcp_config* config) {
+  uint32_t pos = 0;
+  uint32_t step = 1;
+
+  while (step * 2 <= config->block_used_words) {
+    step *= 2;
+  }
+
+  // Descend the fenwick tree, a node covering step words holds
+  // step * BLOCK_INDEX_BITS blocks of which tree[node] are used.
+  for (; step > 0; step >>= 1) {
+    if (pos + step <= config->block_used_words) {
+      uint32_t free_blocks = step * BLOCK_INDEX_BITS - config->block_used_tree[pos + step];
+
+      if (k >= free_blocks) {
+        k -= free_blocks;
+        pos += step;
+      }
+    }
+  }
+
+  return pos * BLOCK_INDEX_BITS + _block_index_select_bit(~config->block_used[pos], k);
+}
+
+int block_table_init(ddhcp_config* config) {
+  DEBUG("block_table_init(config)\n");
+  config->number_of_pages = (config->number_of_blocks + BLOCK_PAGE_SIZE - 1) / BLOCK_PAGE_SIZE;
+  config->block_pages = (ddhcp_block_page**) calloc(sizeof(ddhcp_block_page*), config->number_of_pages);
+  INIT_LIST_HEAD(&config->idle_block_pages);
+
+  if (config->block_pages == NULL) {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Return the number of blocks of page, the last page may be truncated.
+ */
+uint32_t _block_page_blocks(ddhcp_block_page* page, ddhcp_config* config) {
+  uint32_t remaining = config->number_of_blocks - page->blocks[0].index;
+  return remaining < BLOCK_PAGE_SIZE ? remaining : BLOCK_PAGE_SIZE;
+}
+
+void block_table_free(ddhcp_config* config) {
+  for (uint32_t i = 0; i < config->number_of_pages; i++) {
+    ddhcp_block_page* page = config->block_pages[i];
+
+    if (page == NULL) {
+      continue;
+    }
+
+    for (uint32_t j = 0; j < _block_page_blocks(page, config); j++) {
+      block_free(page->blocks + j, config);
+    }
+  }
+
+  // Pages are released only after all blocks are freed, because freeing
+  // a block touches the list of idle pages.
+  for (uint32_t i = 0; i < config->number_of_pages; i++) {
+    free(config->block_pages[i]);
+  }
+
+  INIT_LIST_HEAD(&config->idle_block_pages);
+  free(config->block_pages);
+  config->block_pages = NULL;
+}
+
+void block_table_reclaim(ddhcp_config* config) {
+  ddhcp_block_page* page, *tmp;
+
+  list_for_each_entry_safe(page, tmp, &config->idle_block_pages, idle) {
+    DEBUG("block_table_reclaim(...): release page of block %i\n", page->blocks[0].index);
+
+    for (uint32_t i = 0; i < _block_page_blocks(page, config); i++) {
+      block_free(page->blocks + i, config);
+    }
+
+    list_del(&page->idle);
+    config->block_pages[page->blocks[0].index >> BLOCK_PAGE_BITS] = NULL;
+    free(page);
+  }
+}
+
+ddhcp_block* block_lookup(uint32_t index, ddhcp_config* config) {
+  ddhcp_block_page* page = config->block_pages[index >> BLOCK_PAGE_BITS];
+
+  if (page == NULL) {
+    return NULL;
+  }
+
+  return page->blocks + BLOCK_PAGE_OFFSET(index);
+}
+
+enum ddhcp_block_state block_state(uint32_t index, ddhcp_config* config) {
+  ddhcp_block_page* page = config->block_pages[index >> BLOCK_PAGE_BITS];
+
+  if (page == NULL) {
+    return DDHCP_FREE;
+  }
+
+  return page->states[BLOCK_PAGE_OFFSET(index)];
+}
+
+ddhcp_block* block_materialize(uint32_t index, ddhcp_config* config) {
+  ddhcp_block_page** slot = config->block_pages + (index >> BLOCK_PAGE_BITS);
+
+  if (*slot == NULL) {
+    DEBUG("block_materialize(%i, config)\n", index);
+    ddhcp_block_page* page = (ddhcp_block_page*) calloc(sizeof(ddhcp_block_page), 1);
+
+    if (page == NULL) {
+      ERROR("block_materialize(...) -> Can't allocate memory for block page\n");
+      return NULL;
+    }
+
+    // calloc leaves every block FREE and without timeout.
+    uint32_t first = index & ~(BLOCK_PAGE_SIZE - 1);
+
+    for (int i = 0; i < BLOCK_PAGE_SIZE; i++) {
+      ddhcp_block* block = page->blocks + i;
+      block->index = first + i;
+      addr_add(&config->prefix, &block->subnet, block->index * config->block_size);
+      block->subnet_len = config->block_size;
+      block_timers_init(block);
+      INIT_LIST_HEAD(&block->list);
+    }
+
+    // Until one of its blocks gets used the page is idle.
+    list_add_tail(&page->idle, &config->idle_block_pages);
+    *slot = page;
+  }
+
+  return (*slot)->blocks + BLOCK_PAGE_OFFSET(index);
+}
+
+void _block_page_activate(ddhcp_block_page* page, int delta, ddhcp_config* config) {
+  if (page->active == 0) {
+    list_del_init(&page->idle);
+  }
+
+  page->active += delta;
+
+  if (page->active == 0) {
+    list_add_tail(&page->idle, &config->idle_block_pages);
+  }
+}
+
+void block_set_state(ddhcp_block* block, enum ddhcp_block_state state, ddhcp_config* config) {
+  ddhcp_block_page* page = BLOCK_PAGE(block);
+  uint8_t* current = page->states + BLOCK_PAGE_OFFSET(block->index);
+
+  _block_index_mark(block->index, state != DDHCP_FREE, config);
+
+  if (*current != DDHCP_FREE) {
+    list_del_init(&block->list);
+    config->num_blocks[*current]--;
+  }
+
+  if ((*current == DDHCP_FREE) != (state == DDHCP_FREE)) {
+    _block_page_activate(page, state == DDHCP_FREE ? -1 : 1, config);
+  }
+
+  // Leases of OUR blocks are accounted daemon wide.
+  if (*current == DDHCP_OURS && state != DDHCP_OURS) {
+    for (int i = 0; i < DHCP_LEASE_STATES; i++) {
+      config->num_leases[i] -= block->num_leases[i];
+    }
+  } else if (*current != DDHCP_OURS && state == DDHCP_OURS) {
+    for (int i = 0; i < DHCP_LEASE_STATES; i++) {
+      config->num_leases[i] += block->num_leases[i];
+    }
+  }
+
+  *current = state;
+
+  if (state == DDHCP_FREE) {
+    timer_del(&config->timers, &block->timer);
+  } else {
+    list_add_tail(&block->list, &config->block_lists[state]);
+    config->num_blocks[state]++;
+  }
+}
+
+void _block_timeout(ddhcp_timer* timer, ddhcp_config* config) {
+  ddhcp_block* block = container_of(timer, ddhcp_block, timer);
+
+  uint8_t state = BLOCK_STATE(block);
+
+  if (state != DDHCP_BLOCKED && state != DDHCP_FREE) {
+    INFO("Block %i FREE throught timeout.\n", block->index);
+    block_free(block, config);
+  }
+}
+
+void _block_lease_timeout(ddhcp_timer* timer, ddhcp_config* config) {
+  ddhcp_block* block = container_of(timer, ddhcp_block, lease_timer);
+
+  if (block->addresses == NULL) {
+    return;
+  }
+
+  int free_leases = dhcp_check_timeouts(block, config);
+
+  if (BLOCK_STATE(block) != DDHCP_OURS && free_leases == block->subnet_len) {
+    block_free(block, config);
+  }
+}
+
+void block_timers_init(ddhcp_block* block) {
+  timer_init(&block->timer, _block_timeout);
+  timer_init(&block->lease_timer, _block_lease_timeout);
+}
+
+void block_set_timeout(ddhcp_block* block, time_t timeout, ddhcp_config* config) {
+  BLOCK_TIMEOUT(block) = timeout;
+  // A block times out strictly after its timeout.
+  timer_add(&config->timers, &block->timer, timeout + 1);
+}
+
+void block_schedule_lease_timeout(ddhcp_block* block, time_t lease_end, ddhcp_config* config) {
+  if (!timer_pending(&block->lease_timer) || lease_end + 1 < block->lease_timer.expires) {
+    timer_add(&config->timers, &block->lease_timer, lease_end + 1);
+  }
+}
+
+size_t block_lease_storage_size(uint32_t leases) {
+  return leases * (sizeof(struct dhcp_lease) + sizeof(uint8_t)) + 2 * DHCP_LEASE_WORDS(leases) * sizeof(uint64_t);
+}
+
+int block_alloc(ddhcp_block* block, ddhcp_config* config) {
+  DEBUG("block_alloc(block, config)\n");
+  uint32_t words = DHCP_LEASE_WORDS(block->subnet_len);
+
+  // Slab chunks are zeroed, which leaves every lease FREE.
+  block->addresses = (struct dhcp_lease*) slab_alloc(&config->lease_slab);
 
   if (block->addresses == NULL) {
     return 1;
   }
 
-  for (unsigned int index = 0; index < block->subnet_len; index++) {
-    block->addresses[index].state = FREE;
-    block->addresses[index].lease_end = 0;
+  block->lease_free = (uint64_t*) (block->addresses + block->subnet_len);
+  block->lease_offered = block->lease_free + words;
+  block->lease_states = (uint8_t*) (block->lease_offered + words);
+
+  for (uint32_t i = 0; i < block->subnet_len; i += 64) {
+    uint32_t bits = block->subnet_len - i;
+    block->lease_free[i / 64] = bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
   }
 
+  block->num_leases[FREE] = block->subnet_len;
+
   return 0;
 }
 
 int block_own(ddhcp_block* block,ddhcp_config* config) {
-  if (block_alloc(block)) {
+  if (block_alloc(block, config)) {
     return 1;
   } else {
-    block->state = DDHCP_OURS;
+    block_set_state(block, DDHCP_OURS, config);
     NODE_ID_CP(&block->node_id,&config->node_id);
     return 0;
   }
 }
 
-void block_free(ddhcp_block* block) {
+void block_free(ddhcp_block* block, ddhcp_config* config) {
   DEBUG("block_free(%i)\n", block->index);
 
-  if (block->state != DDHCP_BLOCKED) {
+  if (BLOCK_STATE(block) != DDHCP_BLOCKED) {
     NODE_ID_CLEAR(&block->node_id);
-    block->state = DDHCP_FREE;
+    block_set_state(block, DDHCP_FREE, config);
   }
 
   if (block->addresses) {
     DEBUG("Free DHCP leases for Block %i\n", block->index);
-    free(block->addresses);
+    timer_del(&config->timers, &block->lease_timer);
+
+    for (uint32_t w = 0; w < DHCP_LEASE_WORDS(block->subnet_len); w++) {
+      uint32_t bits = block->subnet_len - w * 64;
+      uint64_t used = ~block->lease_free[w] & (bits >= 64 ? ~0ULL : (1ULL << bits) - 1);
+
+      for (; used; used &= used - 1) {
+        uint32_t lease_index = w * 64 + __builtin_ctzll(used);
+        client_table_del(&config->clients, block->addresses[lease_index].hwaddr, block->index * config->block_size + lease_index);
+      }
+    }
+
+    slab_release(&config->lease_slab, block->addresses);
     block->addresses = NULL;
+    block->lease_states = NULL;
+    block->lease_free = NULL;
+    block->lease_offered = NULL;
+    memset(block->num_leases, 0, sizeof(block->num_leases));
   }
 }
 
-ddhcp_block* block_find_free(ddhcp_config* config) {
-  DEBUG("block_find_free(blocks,config)\n");
-  ddhcp_block* block = config->blocks;
-
-  ddhcp_block_list free_blocks, *tmp;
-  INIT_LIST_HEAD(&free_blocks.list);
-  uint32_t num_free_blocks = 0;
-
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_FREE) {
-      tmp = (ddhcp_block_list*) malloc(sizeof(ddhcp_block_list));
-      tmp->block = block;
-      list_add_tail((&tmp->list), &(free_blocks.list));
-      num_free_blocks++;
-    }
+int _block_contested(uint32_t index, ddhcp_config* config) {
+  time_t now = clock_now();
 
-    block++;
+  for (int i = 0; i < DDHCP_CONTESTED; i++) {
+    if (config->contested[i].index == index && config->contested[i].until > now) {
+      return 1;
+    }
   }
 
-  DEBUG("block_find_free(...): found %i free blocks\n", num_free_blocks);
+  return 0;
+}
 
-  ddhcp_block* random_free = NULL;
-  int r = -1;
+ddhcp_block* block_find_free(ddhcp_config* config) {
+  DEBUG("block_find_free(blocks,config)\n");
+  DEBUG("block_find_free(...): found %i free blocks\n", config->num_free_blocks);
 
-  if (num_free_blocks > 0) {
-    r = rand() % num_free_blocks;
-  } else {
+  if (config->num_free_blocks == 0) {
     DEBUG("block_find_free(...) -> no free block found\n");
     return NULL;
   }
 
-  struct list_head* pos, *q;
-
-  list_for_each_safe(pos, q, &free_blocks.list) {
-    tmp = list_entry(pos, ddhcp_block_list, list);
-    block = tmp->block;
-    list_del(pos);
-    free(tmp);
+  // Nodes claiming at the same time pick from disjoint shares of the blocks
+  // free to the others, without peers the share spans all of them. Blocks
+  // we are claiming were taken from our share, once it is used up we pick
+  // from all free blocks.
+  uint32_t nodes;
+  uint32_t rank = peer_rank(config, &nodes);
+  uint32_t claiming = config->num_blocks[DDHCP_CLAIMING];
+  uint32_t total = config->num_free_blocks + claiming;
+  uint32_t start = (uint64_t) rank * total / nodes;
+  uint32_t end = (uint64_t) (rank + 1) * total / nodes;
+  uint32_t k;
+
+  if (end > start + claiming) {
+    k = start + rand() % (end - start - claiming);
+  } else {
+    k = rand() % config->num_free_blocks;
+  }
+  uint32_t index = _block_index_select_free(k, config);
 
-    if (r == 0) {
-      random_free = block;
+  // At most DDHCP_CONTESTED of the following free blocks are contested.
+  for (uint32_t i = 0; i < DDHCP_CONTESTED && i + 1 < config->num_free_blocks; i++) {
+    if (!_block_contested(index, config)) {
+      break;
     }
 
-    r--;
+    config->contested_skips++;
+    k = (k + 1) % config->num_free_blocks;
+    index = _block_index_select_free(k, config);
+  }
+
+  ddhcp_block* free_block = block_materialize(index, config);
+
+  if (free_block == NULL) {
+    return NULL;
   }
 
-  DEBUG("block_find_free(...)-> block %i\n", random_free->index);
-  return random_free;
+  DEBUG("block_find_free(...)-> block %i\n", free_block->index);
+  return free_block;
+}
+
+uint32_t _block_inquire_tokens(ddhcp_config* config) {
+  time_t now = clock_now();
+  uint64_t tokens = config->inquire_tokens + (uint64_t) (now - config->inquire_tokens_at) * DDHCP_INQUIRE_RATE;
+
+  config->inquire_tokens = tokens < DDHCP_INQUIRE_BURST ? tokens : DDHCP_INQUIRE_BURST;
+  config->inquire_tokens_at = now;
+  return config->inquire_tokens;
 }
 
 int block_claim(int num_blocks, ddhcp_config* config) {
   DEBUG("block_claim(blocks, %i, config)\n", num_blocks);
 
   // Handle blocks already in claiming prozess
-  struct list_head* pos, *q;
-  time_t now = time(NULL);
-
-  list_for_each_safe(pos, q, &(config->claiming_blocks).list) {
-    ddhcp_block_list* tmp = list_entry(pos, ddhcp_block_list, list);
-    ddhcp_block* block = tmp->block;
+  ddhcp_block* block, *tmp;
+  time_t now = clock_now();
 
+  list_for_each_entry_safe(block, tmp, &config->block_lists[DDHCP_CLAIMING], list) {
     if (block->claiming_counts == 3) {
-      block_own(block,config);
+      block_own(block, config);
 
       // TODO Error Handling
 
       //Reduce number of blocks we need to claim
       num_blocks--;
+      config->claim_backoff = 0;
 
       INFO("Block %i claimed after 3 claims.\n", block->index);
-      list_del(pos);
-      config->claiming_blocks_amount--;
-      free(tmp);
-    } else if (block->state != DDHCP_CLAIMING) {
-      DEBUG("block_claim(...): block %i is no longer marked as claiming\n", block->index);
-      list_del(pos);
-      config->claiming_blocks_amount--;
-      free(tmp);
     }
   }
 
+  uint32_t claiming_blocks = config->num_blocks[DDHCP_CLAIMING];
+  uint32_t tokens = _block_inquire_tokens(config);
+
   // Do we still need more, then lets find some.
-  if ((unsigned int) num_blocks > config->claiming_blocks_amount) {
-    // find num_blocks - config->claiming_blocks_amount free blocks
-    int needed_blocks = num_blocks - config->claiming_blocks_amount;
+  if (num_blocks > 0 && (uint32_t) num_blocks > claiming_blocks && now >= config->claim_backoff_until) {
+    // find num_blocks - claiming_blocks free blocks
+    int needed_blocks = num_blocks - claiming_blocks;
+
+    // Do not pick more blocks than we may inquire.
+    if ((uint32_t) needed_blocks + claiming_blocks > tokens) {
+      needed_blocks = tokens > claiming_blocks ? tokens - claiming_blocks : 0;
+    }
 
     for (int i = 0 ; i < needed_blocks ; i++) {
-      ddhcp_block* block = block_find_free(config);
+      block = block_find_free(config);
 
       if (block != NULL) {
-        ddhcp_block_list* list = (ddhcp_block_list*) malloc(sizeof(ddhcp_block_list));
-
-        // TODO Error Handling
-
-        block->state = DDHCP_CLAIMING;
+        block_set_state(block, DDHCP_CLAIMING, config);
         block->claiming_counts = 0;
-        block->timeout = now + config->tentative_timeout;
-        list->block = block;
-        list_add_tail(&(list->list), &(config->claiming_blocks.list));
-        config->claiming_blocks_amount++;
       } else {
         // We are short on free blocks in the network.
         WARNING("Warning: Network has no free blocks left!\n");
@@ -160,22 +515,30 @@ int block_claim(int num_blocks, ddhcp_config* config) {
   // TODO If we have more blocks in claiming process than we need, drop the tail
   //      of blocks for which we had less claim announcements.
 
-  if (config->claiming_blocks_amount < 1) {
+  claiming_blocks = config->num_blocks[DDHCP_CLAIMING];
+
+  if (claiming_blocks < 1) {
     DEBUG("block_claim(...)-> No blocks need claiming.\n");
     return 0;
   }
 
   // Send claim message for all blocks in claiming process.
   struct ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_INQUIRE, config);
-  packet->count = config->claiming_blocks_amount;
+  packet->count = claiming_blocks;
 
-  packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), config->claiming_blocks_amount);
+  packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), claiming_blocks);
   // TODO Check we actually got the memory
 
-  int index = 0;
-  ddhcp_block_list*  tmp;
-  list_for_each_entry(tmp, &(config->claiming_blocks).list, list) {
-    ddhcp_block* block = tmp->block;
+  uint32_t index = 0;
+  list_for_each_entry(block, &config->block_lists[DDHCP_CLAIMING], list) {
+    // The block must not time out while we are still inquiring it.
+    block_set_timeout(block, now + config->tentative_timeout, config);
+
+    if (index == tokens) {
+      config->inquires_paced++;
+      continue;
+    }
+
     block->claiming_counts++;
     packet->payload[index].block_index = block->index;
     packet->payload[index].timeout = 0;
@@ -183,53 +546,100 @@ int block_claim(int num_blocks, ddhcp_config* config) {
     index++;
   }
 
-  send_packet_mcast(packet, config->mcast_socket, config->mcast_scope_id);
+  config->inquire_tokens -= index;
+  packet->count = index;
+
+  if (index > 0) {
+    send_packet_mcast_batch(packet, config);
+  }
 
   free(packet->payload);
   free(packet);
   return 0;
 }
 
+time_t block_claim_next_round(ddhcp_config* config) {
+  time_t now = clock_now();
+  // Blocks being claimed time out tentative_timeout after the last round.
+  uint32_t jitter = config->tentative_timeout > config->claim_interval ? config->tentative_timeout - config->claim_interval : 0;
+  time_t next = now + config->claim_interval + rand() % (jitter + 1);
+
+  if (config->num_blocks[DDHCP_CLAIMING] == 0 && config->claim_backoff_until > next) {
+    return config->claim_backoff_until;
+  }
+
+  return next;
+}
+
+void block_claim_collision(ddhcp_block* block, ddhcp_config* config) {
+  config->collisions_lost++;
+
+  // Remember the block for a block timeout, until then the winner claims it.
+  ddhcp_contested* contested = config->contested + config->contested_next;
+  contested->index = block->index;
+  contested->until = clock_now() + config->block_timeout;
+  config->contested_next = (config->contested_next + 1) % DDHCP_CONTESTED;
+
+  if (config->claim_backoff < DDHCP_CLAIM_BACKOFF_MAX) {
+    config->claim_backoff++;
+  }
+
+  time_t window = (time_t) config->claim_interval << config->claim_backoff;
+  config->claim_backoff_until = clock_now() + 1 + rand() % window;
+  DEBUG("block_claim_collision(%i, config) -> back off for up to %li secs\n", block->index, (long) window);
+}
+
+void block_claim_show_status(int fd, ddhcp_config* config) {
+  long backoff = config->claim_backoff_until > clock_now() ? (long) (config->claim_backoff_until - clock_now()) : 0;
+  uint32_t nodes;
+  uint32_t rank = peer_rank(config, &nodes);
+  dprintf(fd, "claims\n");
+  dprintf(fd, "      collisions lost/won\t%lu/%lu\n", (unsigned long) config->collisions_lost, (unsigned long) config->collisions_won);
+  dprintf(fd, "      backoff level/remaining\t%u/%li\n", config->claim_backoff, backoff);
+  dprintf(fd, "      inquire tokens\t%u\n", config->inquire_tokens);
+  dprintf(fd, "      paced inquires\t%lu\n", (unsigned long) config->inquires_paced);
+  dprintf(fd, "      free block share\t%u/%u\n", rank + 1, nodes);
+  dprintf(fd, "      contested skips\t%lu\n", (unsigned long) config->contested_skips);
+}
+
 int block_num_free_leases(ddhcp_config* config) {
   DEBUG("block_num_free_leases(blocks, config)\n");
-  ddhcp_block* block = config->blocks;
-  int free_leases = 0;
-#if LOG_LEVEL >= LOG_DEBUG
-  int num_blocks = 0;
-#endif
+  int free_leases = config->num_leases[FREE];
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
-      free_leases += dhcp_num_free(block);
-#if LOG_LEVEL >= LOG_DEBUG
-      num_blocks++;
-#endif
-    }
+#ifndef NDEBUG
+  ddhcp_block* block;
+  uint32_t num_leases[DHCP_LEASE_STATES] = { 0 };
+
+  list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+    dhcp_check_counts(block);
 
-    block++;
+    for (int i = 0; i < DHCP_LEASE_STATES; i++) {
+      num_leases[i] += block->num_leases[i];
+    }
   }
 
-  DEBUG("block_num_free_leases(...)-> Found %i free dhcp leases in OUR (%i) blocks\n", free_leases, num_blocks);
+  assert(memcmp(num_leases, config->num_leases, sizeof(num_leases)) == 0);
+#endif
+
+  DEBUG("block_num_free_leases(...)-> Found %i free dhcp leases in OUR (%i) blocks\n", free_leases, config->num_blocks[DDHCP_OURS]);
   return free_leases;
 }
 
 ddhcp_block* block_find_free_leases(ddhcp_config* config) {
   DEBUG("block_find_free_leases(blocks,config)\n");
-  ddhcp_block* block = config->blocks;
+  ddhcp_block* block;
   ddhcp_block* selected = NULL;
   uint32_t selected_free_leases = config->block_size + 1;
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS) {
-      uint32_t free_leases = dhcp_num_free(block);
+  list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+    uint32_t free_leases = dhcp_num_free(block);
 
-      if (free_leases > 0) {
-        if (free_leases < selected_free_leases) {
-          selected = block;
-        }
+    if (free_leases > 0) {
+      if (free_leases < selected_free_leases) {
+        selected = block;
+        selected_free_leases = free_leases;
       }
     }
-    block++;
   }
 
 #if LOG_LEVEL >= LOG_DEBUG
@@ -244,106 +654,124 @@ ddhcp_block* block_find_free_leases(ddhcp_config* config) {
   return selected;
 }
 
-void block_update_claims(int blocks_needed, ddhcp_config* config) {
-  DEBUG("block_update_claims(blocks, %i, config)\n", blocks_needed);
-  unsigned int our_blocks = 0;
-  ddhcp_block* block = config->blocks;
-  time_t now = time(NULL);
-  int timeout_half = floor((double) config->block_timeout * config->block_refresh_factor / (config->block_refresh_factor + 1));
-  int blocks_needed_tmp = blocks_needed;
+ddhcp_block* block_find_free_leases_near(uint32_t origin, ddhcp_config* config) {
+  DEBUG("block_find_free_leases_near(%u,config)\n", origin);
+  ddhcp_block* block;
+  ddhcp_block* selected = NULL;
+  uint32_t selected_distance = UINT32_MAX;
+  uint32_t selected_free_leases = 0;
 
-  // TODO Use a linked list instead of processing the block list twice.
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS && block->timeout < now + timeout_half) {
-      if (blocks_needed_tmp < 0 && dhcp_num_free(block) == config->block_size) {
-        DEBUG("block_update_claims(...): block %i no longer needed\n", block->index);
-        blocks_needed_tmp--;
-        block_free(block);
-      } else {
-        our_blocks++;
-      }
+  list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+    uint32_t free_leases = dhcp_num_free(block);
+    uint32_t distance = block->index > origin ? block->index - origin : origin - block->index;
+
+    if (free_leases == 0) {
+      continue;
     }
 
-    block++;
+    if (distance < selected_distance || (distance == selected_distance && free_leases < selected_free_leases)) {
+      selected = block;
+      selected_distance = distance;
+      selected_free_leases = free_leases;
+    }
   }
 
-  if (our_blocks == 0) {
+  return selected;
+}
+
+int _block_update_margin(ddhcp_config* config) {
+  return floor((double) config->block_timeout * config->block_refresh_factor / (config->block_refresh_factor + 1));
+}
+
+time_t _block_claim_period(ddhcp_config* config) {
+  time_t period = config->block_timeout - _block_update_margin(config);
+  return period > 0 ? period : 1;
+}
+
+void block_update_claims(int blocks_needed, ddhcp_config* config) {
+  DEBUG("block_update_claims(blocks, %i, config)\n", blocks_needed);
+  unsigned int our_blocks = 0;
+  ddhcp_block* block, *tmp;
+  time_t now = clock_now();
+  int timeout_half = _block_update_margin(config);
+  int blocks_needed_tmp = blocks_needed;
+
+  if (config->num_blocks[DDHCP_OURS] == 0) {
     DEBUG("block_update_claims(...)-> No blocks need claim update.\n");
+    config->claim_epoch = 0;
     return;
   }
 
-  struct ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_UPDATECLAIM, config);
+  // A block refreshed in an epoch is due again exactly in the next one,
+  // blocks announced in between are due only after it.
+  int epoch = config->claim_epoch != 0 && now >= config->claim_epoch;
 
-  packet->count = our_blocks;
+  struct ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_UPDATECLAIM, config);
 
-  packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), our_blocks);
+  packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), config->num_blocks[DDHCP_OURS]);
 
   // TODO Check we actually got the memory
 
-  int index = 0;
-
-  block = config->blocks;
-
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->state == DDHCP_OURS && block->timeout < now + timeout_half) {
-      packet->payload[index].block_index = block->index;
-      packet->payload[index].timeout     = config->block_timeout;
-      packet->payload[index].reserved    = 0;
-      index++;
-      block->timeout = now + config->block_timeout;
-      DEBUG("block_update_claims(...): update claim for block %i\n", block->index);
+  list_for_each_entry_safe(block, tmp, &config->block_lists[DDHCP_OURS], list) {
+    if (epoch || BLOCK_TIMEOUT(block) < now + timeout_half) {
+      if (blocks_needed_tmp < 0 && dhcp_num_free(block) == config->block_size) {
+        DEBUG("block_update_claims(...): block %i no longer needed\n", block->index);
+        blocks_needed_tmp++;
+        block_free(block, config);
+      } else {
+        packet->payload[our_blocks].block_index = block->index;
+        packet->payload[our_blocks].timeout     = config->block_timeout;
+        packet->payload[our_blocks].reserved    = DDHCP_CLAIM_CAP_RANGES;
+        packet->payload[our_blocks].length      = 1;
+        our_blocks++;
+        block_set_timeout(block, now + config->block_timeout, config);
+        DEBUG("block_update_claims(...): update claim for block %i\n", block->index);
+      }
     }
-
-    block++;
   }
 
-  send_packet_mcast(packet, config->mcast_socket, config->mcast_scope_id);
-
-  free(packet->payload);
-  free(packet);
-}
-
-void block_check_timeouts(ddhcp_config* config) {
-  DEBUG("block_check_timeouts(blocks, config)\n");
-  ddhcp_block* block = config->blocks;
-  time_t now = time(NULL);
+  if (epoch || config->claim_epoch == 0) {
+    // Epochs are aligned to multiples of the period.
+    time_t period = _block_claim_period(config);
+    config->claim_epoch = (now / period + 1) * period;
+  }
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    if (block->timeout < now && block->state != DDHCP_BLOCKED && block->state != DDHCP_FREE) {
-      INFO("Block %i FREE throught timeout.\n", block->index);
-      block_free(block);
-    }
+  if (epoch) {
+    config->claim_epochs++;
+  } else if (our_blocks > 0) {
+    config->claim_updates_between++;
+  }
 
-    if (block->state == DDHCP_OURS) {
-      dhcp_check_timeouts(block);
-    } else if (block->addresses != NULL) {
-      int free_leases = dhcp_check_timeouts(block);
+  if (our_blocks == 0) {
+    DEBUG("block_update_claims(...)-> No blocks need claim update.\n");
+  } else {
+    packet->count = our_blocks;
 
-      if (free_leases == block->subnet_len) {
-        block_free(block);
-      }
+    if (peer_all_support_ranges(config)) {
+      packet_compress_claims(packet);
     }
 
-    block++;
+    send_packet_mcast_batch(packet, config);
   }
+
+  free(packet->payload);
+  free(packet);
 }
 
-void block_free_claims(ddhcp_config* config) {
-  if (list_empty(&config->claiming_blocks.list)) {
-    return;
+time_t block_next_update(ddhcp_config* config) {
+  if (config->num_blocks[DDHCP_OURS] == 0) {
+    return 0;
   }
 
-  struct list_head* pos, *q;
+  return config->claim_epoch;
+}
 
-  list_for_each_safe(pos, q, &(config->claiming_blocks).list) {
-    ddhcp_block_list* tmp = list_entry(pos, ddhcp_block_list, list);
-    list_del(pos);
-    free(tmp);
-  }
+void block_check_timeouts(ddhcp_config* config) {
+  DEBUG("block_check_timeouts(blocks, config)\n");
+  timer_wheel_run(&config->timers, clock_now(), config);
 }
 
 void block_show_status(int fd, ddhcp_config* config) {
-  ddhcp_block* block = config->blocks;
   dprintf(fd, "block size/number\t%u/%u \n", config->block_size, config->number_of_blocks);
   dprintf(fd, "      tentative timeout\t%u\n", config->tentative_timeout);
   dprintf(fd, "      timeout\t%u\n", config->block_timeout);
@@ -362,42 +790,51 @@ void block_show_status(int fd, ddhcp_config* config) {
   dprintf(fd, "ddhcp blocks\n");
   dprintf(fd, "index\tstate\towner\t\t\tclaim\tleases\ttimeout\n");
 
-  time_t now = time(NULL);
+  time_t now = clock_now();
 
   uint32_t num_reserved_blocks = 0;
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    uint32_t free_leases = 0;
-    uint32_t offered_leases = 0;
+  for (uint32_t i = 0; i < config->number_of_pages; i++) {
+    ddhcp_block_page* page = config->block_pages[i];
 
-    if (block->addresses != NULL) {
-      free_leases = dhcp_num_free(block);
-      offered_leases = dhcp_num_offered(block);
+    if (page == NULL) {
+      continue;
     }
 
-    for( uint32_t j = 0; j < 8; j++) {
-      sprintf(node_id + 2 * j,"%02X",block->node_id[j]);
-    }
-    node_id[16] = '\0';
-    
-    char leases[10];
-    if ( block->addresses != NULL ) {
-      sprintf(leases,"%u/%u",offered_leases ,config->block_size - free_leases - offered_leases);
-    } else {
-      leases[0] = '-';
-      leases[1] = '\0';
-    }
+    // Decide on the hot data of the page, before touching the block.
+    for (uint32_t j = scan_find_other(page->states, BLOCK_PAGE_SIZE, DDHCP_FREE); j < BLOCK_PAGE_SIZE;
+         j += 1 + scan_find_other(page->states + j + 1, BLOCK_PAGE_SIZE - j - 1, DDHCP_FREE)) {
+      if (page->timeouts[j] <= now) {
+        continue;
+      }
+
+      ddhcp_block* block = page->blocks + j;
+      time_t timeout = page->timeouts[j] - now;
+      uint32_t free_leases = 0;
+      uint32_t offered_leases = 0;
+
+      if (block->addresses != NULL) {
+        free_leases = dhcp_num_free(block);
+        offered_leases = dhcp_num_offered(block);
+      }
+
+      for( uint32_t k = 0; k < 8; k++) {
+        sprintf(node_id + 2 * k,"%02X",block->node_id[k]);
+      }
+      node_id[16] = '\0';
+
+      char leases[10];
+      if ( block->addresses != NULL ) {
+        sprintf(leases,"%u/%u",offered_leases ,config->block_size - free_leases - offered_leases);
+      } else {
+        leases[0] = '-';
+        leases[1] = '\0';
+      }
 
-    time_t timeout = 0;
-    if ( block->timeout > now ) {
-      timeout = block->timeout - now;
-    }
-    
-    if (timeout > 0) {
       num_reserved_blocks++;
-      dprintf(fd, "%i\t%i\t%s\t%u\t%s\t%lu\n", block->index, block->state, node_id, block->claiming_counts, leases, timeout);
+      dprintf(fd, "%i\t%i\t%s\t%u\t%s\t%lu\n", block->index, page->states[j], node_id, block->claiming_counts, leases, timeout);
     }
-
-    block++;
   }
   dprintf(fd,"\nblocks in use: %i\n",num_reserved_blocks);
+  dprintf(fd,"blocks ours: %u\n",config->num_blocks[DDHCP_OURS]);
+  dprintf(fd,"leases free/offered/leased: %u/%u/%u\n",config->num_leases[FREE],config->num_leases[OFFERED],config->num_leases[LEASED]);
 }
@@ -4,11 +4,86 @@
 #include "types.h"
 #include "packet.h"
 
+/**
+ * Prepare the index of free blocks, all blocks are marked as free.
+ * Returns a value greater 0 if we are out of memory.
+ */
+int block_index_init(ddhcp_config* config);
+
+/**
+ * Release the index of free blocks.
+ */
+void block_index_free(ddhcp_config* config);
+
+/**
+ * Prepare the sparse table of blocks, no block is materialized yet.
+ * Returns a value greater 0 if we are out of memory.
+ */
+int block_table_init(ddhcp_config* config);
+
+/**
+ * Free all blocks and the table of blocks.
+ */
+void block_table_free(ddhcp_config* config);
+
+/**
+ * Release pages of the block table which hold FREE blocks only.
+ * Pointers to blocks of these pages become invalid.
+ */
+void block_table_reclaim(ddhcp_config* config);
+
+/**
+ * Return the block with the given index, or null if the block is not
+ * materialized. Blocks which are not materialized are FREE.
+ */
+ddhcp_block* block_lookup(uint32_t index, ddhcp_config* config);
+
+/**
+ * Return the state of the block with the given index, without
+ * materializing it.
+ */
+enum ddhcp_block_state block_state(uint32_t index, ddhcp_config* config);
+
+/**
+ * Return the block with the given index, materialize it when necessary.
+ * Returns null if we are out of memory.
+ */
+ddhcp_block* block_materialize(uint32_t index, ddhcp_config* config);
+
+/**
+ * Change the state of a block. Every state transition of a block must pass
+ * this function, so the index of free blocks and the per state lists of
+ * blocks are kept up to date.
+ */
+void block_set_state(ddhcp_block* block, enum ddhcp_block_state state, ddhcp_config* config);
+
+/**
+ * Prepare the timers of a block.
+ */
+void block_timers_init(ddhcp_block* block);
+
+/**
+ * Set the timeout of a block and schedule its timer accordingly.
+ */
+void block_set_timeout(ddhcp_block* block, time_t timeout, ddhcp_config* config);
+
+/**
+ * Make sure the lease timer of the block fires no later than the
+ * expiry of a lease ending at lease_end.
+ */
+void block_schedule_lease_timeout(ddhcp_block* block, time_t lease_end, ddhcp_config* config);
+
+/**
+ * Return the size of the storage for the leases of a block, holding the
+ * leases, their bitmaps and states.
+ */
+size_t block_lease_storage_size(uint32_t leases);
+
 /**
  * Allocate block.
- * This will also malloc and prepare a dhcp_lease_block inside the given block.
+ * This will also take and prepare a dhcp_lease_block from the lease slab.
  */
-int block_alloc(ddhcp_block* block);
+int block_alloc(ddhcp_block* block, ddhcp_config* config);
 
 /**
  * Own a block, possibly after you have claimed it an amount of times.
@@ -19,20 +94,44 @@ int block_own(ddhcp_block* block, ddhcp_config* config);
 /**
  * Free a block and release dhcp_lease_block when allocated.
  */
-void block_free(ddhcp_block* block);
+void block_free(ddhcp_block* block, ddhcp_config* config);
 
 /**
  * Find a free block and return it or otherwise null.
  * A block is called free, when no other node claims it.
+ * The free blocks are split into one share per node we know of, in the
+ * order of node ids, and the block is picked at random from our share.
+ * Blocks recently lost to another node are skipped.
  */
 ddhcp_block* block_find_free(ddhcp_config* config);
 
 /**
  * Claim a block! A block is only claimable when it is free.
+ * New blocks are only picked outside of a backoff and the inquires sent
+ * are paced by a token bucket, blocks left out are inquired later.
  * Returns a value greater 0 if something goes sideways.
  */
 int block_claim(int num_blocks , ddhcp_config* config);
 
+/**
+ * Return when the next claim round is due: after the claim interval plus a
+ * random jitter, keeping blocks being claimed from timing out. While no
+ * block is being claimed the round waits for the end of a backoff.
+ */
+time_t block_claim_next_round(ddhcp_config* config);
+
+/**
+ * Note a block we were claiming was lost to another node. Picking new blocks
+ * is delayed by a random time in an exponentially growing window and the
+ * block is not picked again for a block timeout.
+ */
+void block_claim_collision(ddhcp_block* block, ddhcp_config* config);
+
+/**
+ * Print the claim counters into given file descriptor.
+ */
+void block_claim_show_status(int fd, ddhcp_config* config);
+
 /**
  * Sum the number of free leases in blocks you own.
  */
@@ -46,24 +145,35 @@ int block_num_free_leases(ddhcp_config* config);
 ddhcp_block* block_find_free_leases(ddhcp_config* config);
 
 /**
- *  Update the timeout of claimed blocks and send packets to
+ * Find and return our block with free leases closest to the block at
+ * origin, preferring used blocks among equally close ones.
+ * Returns NULL if none of our blocks has free leases.
+ */
+ddhcp_block* block_find_free_leases_near(uint32_t origin, ddhcp_config* config);
+
+/**
+ *  Update the timeout of our blocks and send packets to
  *  distribute the continuations of that claim.
  *
- *  Due to fragmented timeouts this packet may send 2 times more packets
- *  than optimal. TODO fixthis
+ *  All our blocks are refreshed together once per claim epoch, every
+ *  block_timeout / (block_refresh_factor + 1) seconds. Blocks announced in
+ *  between, newly owned ones or those another node inquired, are refreshed
+ *  along with the others in the next epoch.
  */
 void block_update_claims(int blocks_needed, ddhcp_config* config);
 
 /**
- * Check the timeout of all blocks, and mark timed out once as FREE.
- * Blocks which are marked as BLOCKED are ignored in this process.
+ * Return the point in time block_update_claims has to refresh our blocks,
+ * the next claim epoch, or 0 if we own no block.
  */
-void block_check_timeouts(ddhcp_config* config);
+time_t block_next_update(ddhcp_config* config);
 
 /**
- * Free block claim list structure.
+ * Run the timers of all blocks which expired until now. Timed out blocks
+ * are marked as FREE and timed out leases are released.
+ * Blocks which are marked as BLOCKED are ignored in this process.
  */
-void block_free_claims(ddhcp_config* config);
+void block_check_timeouts(ddhcp_config* config);
 
 /**
  * Show Block Status
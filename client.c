@@ -0,0 +1,136 @@
+#include "client.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+#define CLIENT_TABLE_INITIAL_SIZE 64
+
+uint32_t _client_hash(uint8_t* hwaddr) {
+  uint64_t key = 0;
+  memcpy(&key, hwaddr, DHCP_HWADDR_LEN);
+
+  uint64_t hash = (key ^ (key >> 29)) * 0xBF58476D1CE4E5B9ULL;
+  return (uint32_t)(hash >> 32);
+}
+
+/**
+ * Return the slot of hwaddr, or the empty slot where it would be inserted.
+ */
+ddhcp_client* _client_table_slot(ddhcp_client_table* table, uint8_t* hwaddr) {
+  uint32_t mask = table->size - 1;
+  uint32_t i = _client_hash(hwaddr) & mask;
+
+  while (table->clients[i].used && HWADDR_CMP(table->clients[i].hwaddr, hwaddr) != 0) {
+    i = (i + 1) & mask;
+  }
+
+  return table->clients + i;
+}
+
+int _client_table_resize(ddhcp_client_table* table, uint32_t size) {
+  DEBUG("_client_table_resize(table, %u)\n", size);
+  ddhcp_client* old = table->clients;
+  uint32_t old_size = table->size;
+
+  table->clients = (ddhcp_client*) calloc(sizeof(ddhcp_client), size);
+
+  if (table->clients == NULL) {
+    table->clients = old;
+    return 1;
+  }
+
+  table->size = size;
+
+  for (uint32_t i = 0; i < old_size; i++) {
+    if (old[i].used) {
+      memcpy(_client_table_slot(table, old[i].hwaddr), old + i, sizeof(ddhcp_client));
+    }
+  }
+
+  free(old);
+  return 0;
+}
+
+int client_table_init(ddhcp_client_table* table) {
+  table->clients = NULL;
+  table->size = 0;
+  table->count = 0;
+  table->unindexed = 0;
+
+  return _client_table_resize(table, CLIENT_TABLE_INITIAL_SIZE);
+}
+
+void client_table_free(ddhcp_client_table* table) {
+  free(table->clients);
+  table->clients = NULL;
+  table->size = 0;
+  table->count = 0;
+}
+
+ddhcp_client* client_table_find(ddhcp_client_table* table, uint8_t* hwaddr) {
+  ddhcp_client* client = _client_table_slot(table, hwaddr);
+
+  if (!client->used) {
+    return NULL;
+  }
+
+  return client;
+}
+
+int client_table_set(ddhcp_client_table* table, uint8_t* hwaddr, uint32_t offset) {
+  ddhcp_client* client = _client_table_slot(table, hwaddr);
+
+  // Keep the load factor below 3/4.
+  if (!client->used && 4 * (table->count + 1) > 3 * table->size) {
+    if (_client_table_resize(table, table->size * 2)) {
+      ERROR("client_table_set(...): can't allocate memory for client table\n");
+      table->unindexed++;
+      return 1;
+    }
+
+    client = _client_table_slot(table, hwaddr);
+  }
+
+  if (!client->used) {
+    HWADDR_CP(client->hwaddr, hwaddr);
+    client->used = 1;
+    table->count++;
+  }
+
+  client->offset = offset;
+
+  return 0;
+}
+
+void client_table_del(ddhcp_client_table* table, uint8_t* hwaddr, uint32_t offset) {
+  ddhcp_client* client = client_table_find(table, hwaddr);
+
+  if (client == NULL || client->offset != offset) {
+    return;
+  }
+
+  uint32_t mask = table->size - 1;
+  uint32_t hole = client - table->clients;
+  uint32_t i = hole;
+
+  // Shift back entries which would not be found behind the hole.
+  for (;;) {
+    i = (i + 1) & mask;
+
+    if (!table->clients[i].used) {
+      break;
+    }
+
+    uint32_t home = _client_hash(table->clients[i].hwaddr) & mask;
+
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      table->clients[hole] = table->clients[i];
+      hole = i;
+    }
+  }
+
+  table->clients[hole].used = 0;
+  table->count--;
+}
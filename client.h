@@ -0,0 +1,42 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include "types.h"
+
+/**
+ * Table of clients holding an offered or leased address in one of our
+ * blocks, keyed by their hardware address. Collisions are resolved by
+ * linear probing, deleted entries are closed by shifting back the following
+ * entries, so no tombstones are left behind.
+ */
+
+/**
+ * Initialize an empty client table.
+ * Returns a value greater 0 if we are out of memory.
+ */
+int client_table_init(ddhcp_client_table* table);
+
+/**
+ * Free the client table.
+ */
+void client_table_free(ddhcp_client_table* table);
+
+/**
+ * Find the client with hardware address hwaddr, returns null if the client is unknown.
+ */
+ddhcp_client* client_table_find(ddhcp_client_table* table, uint8_t* hwaddr);
+
+/**
+ * Register the lease at offset in our prefix for a client, a previous lease
+ * of this client is replaced.
+ * Returns a value greater 0 if we are out of memory, the client is then
+ * counted as unindexed and has to be searched for in the blocks.
+ */
+int client_table_set(ddhcp_client_table* table, uint8_t* hwaddr, uint32_t offset);
+
+/**
+ * Remove a client, iff it is still registered with the lease at offset.
+ */
+void client_table_del(ddhcp_client_table* table, uint8_t* hwaddr, uint32_t offset);
+
+#endif
@@ -0,0 +1,21 @@
+#include "clock.h"
+
+#include "logger.h"
+
+time_t clock_sample = 0;
+
+time_t clock_update(void) {
+  struct timespec now;
+
+  if (clock_gettime(DDHCP_CLOCK, &now) < 0) {
+    ERROR("clock_update(): Unable to read the clock\n");
+    return clock_sample;
+  }
+
+  clock_sample = now.tv_sec;
+  return clock_sample;
+}
+
+void clock_set(time_t now) {
+  clock_sample = now;
+}
@@ -0,0 +1,36 @@
+#ifndef _CLOCK_H
+#define _CLOCK_H
+
+#include <time.h>
+
+/**
+ * The daemon clock, counting seconds since boot.
+ *
+ * All timeouts are kept on this clock. Unlike the wall clock it is not
+ * stepped by NTP, so a router syncing its time after boot neither expires
+ * nor keeps alive its blocks and leases. It continues to count while the
+ * system is suspended.
+ *
+ * The clock is sampled once per iteration of the event loop, reading it is
+ * as cheap as reading a variable.
+ */
+#define DDHCP_CLOCK CLOCK_BOOTTIME
+
+extern time_t clock_sample;
+
+/**
+ * Sample the daemon clock and return the new time.
+ */
+time_t clock_update(void);
+
+/**
+ * The time of the last sample.
+ */
+#define clock_now() (clock_sample)
+
+/**
+ * Replace the sample with a synthetic time, for tests.
+ */
+void clock_set(time_t now);
+
+#endif
@@ -1,7 +1,35 @@
 #include "control.h"
 #include "logger.h"
+#include "batch.h"
 #include "block.h"
+#include "clock.h"
+#include "dhcp.h"
 #include "dhcp_options.h"
+#include "packet.h"
+#include "peer.h"
+#include "slab.h"
+
+void control_show_stats(int socket, ddhcp_config* config) {
+  long next_wakeup = config->next_wakeup ? (long) (config->next_wakeup - clock_now()) : -1;
+  dprintf(socket, "scheduler\n");
+  dprintf(socket, "      next wakeup in\t%li\n", next_wakeup);
+  dprintf(socket, "      wakeups/house keeping\t%lu/%lu\n", (unsigned long) config->wakeups, (unsigned long) config->house_keeping_runs);
+  long claim_epoch = config->claim_epoch ? (long) (config->claim_epoch - clock_now()) : -1;
+  dprintf(socket, "      next claim epoch in\t%li\n", claim_epoch);
+  dprintf(socket, "      claim epochs/updates between\t%lu/%lu\n", (unsigned long) config->claim_epochs, (unsigned long) config->claim_updates_between);
+  slab_show_status(socket, "lease", &config->lease_slab);
+  dhcp_reply_show_status(socket, config);
+  dhcp_relay_show_status(socket, config);
+  batch_show_status(socket, "mcast", &config->mcast_recv);
+  batch_show_status(socket, "server", &config->server_recv);
+  batch_show_status(socket, "client", &config->client_recv);
+  batch_queue_show_status(socket, "mcast", &config->mcast_queue);
+  batch_queue_show_status(socket, "server", &config->server_queue);
+  batch_queue_show_status(socket, "client", &config->client_queue);
+  block_claim_show_status(socket, config);
+  send_packet_show_status(socket, config);
+  peer_show_status(socket, config);
+}
 
 int handle_command(int socket, uint8_t* buffer, int msglen, ddhcp_config* config) {
   // TODO Rethink command handling and command design
@@ -68,6 +96,16 @@ int handle_command(int socket, uint8_t* buffer, int msglen, ddhcp_config* config
     remove_option_in_store(&config->options, code);
     return 0;
 
+  case DDHCPCTL_STATS_SHOW:
+    if (msglen != 1) {
+      DEBUG("handle_command(...) -> message length mismatch\n");
+      return -2;
+    }
+
+    DEBUG("handle_command(...) -> show statistics\n");
+    control_show_stats(socket, config);
+    return 0;
+
   default:
     WARNING("handle_command(...) -> unknown command\n");
   }
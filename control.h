@@ -7,6 +7,7 @@
 #define DDHCPCTL_DHCP_OPTIONS_SHOW 2
 #define DDHCPCTL_DHCP_OPTION_SET 3
 #define DDHCPCTL_DHCP_OPTION_REMOVE 4
+#define DDHCPCTL_STATS_SHOW 5
 
 int handle_command(int socket, uint8_t* buffer, int msglen, ddhcp_config* config);
 
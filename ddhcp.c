@@ -1,8 +1,13 @@
 #include <assert.h>
 
+#include "client.h"
+#include "clock.h"
 #include "ddhcp.h"
 #include "dhcp.h"
 #include "logger.h"
+#include "peer.h"
+#include "slab.h"
+#include "timer.h"
 #include "tools.h"
 
 int ddhcp_block_init(ddhcp_config* config) {
@@ -13,43 +18,54 @@ int ddhcp_block_init(ddhcp_config* config) {
   }
 
   DEBUG("ddhcp_block_init(config)\n");
-  config->blocks = (struct ddhcp_block*) calloc(sizeof(struct ddhcp_block), config->number_of_blocks);
 
-  if (config->blocks == NULL) {
+  // Blocks are materialized lazily, when they leave the FREE state.
+  if (block_table_init(config)) {
     FATAL("ddhcp_block_init(...)-> Can't allocate memory for block structure\n");
     return 1;
   }
 
-  time_t now = time(NULL);
-
-  // TODO Maybe we should allocate number_of_blocks dhcp_lease_blocks previous
-  //      and assign one here instead of NULL. Performance boost, Memory defrag?
-  struct ddhcp_block* block = config->blocks;
-
-  for (uint32_t index = 0; index < config->number_of_blocks; index++) {
-    block->index = index;
-    block->state = DDHCP_FREE;
-    addr_add(&config->prefix, &block->subnet, index * config->block_size);
-    block->subnet_len = config->block_size;
-    memset(&block->owner_address, 0, sizeof(struct in6_addr));
-    block->timeout = now + config->block_timeout;
-    block->claiming_counts = 0;
-    block->addresses = NULL;
-    block++;
+  if (block_index_init(config)) {
+    FATAL("ddhcp_block_init(...)-> Can't allocate memory for free block index\n");
+    block_table_free(config);
+    return 1;
   }
 
-  return 0;
-}
+  if (client_table_init(&config->clients)) {
+    FATAL("ddhcp_block_init(...)-> Can't allocate memory for client table\n");
+    block_index_free(config);
+    block_table_free(config);
+    return 1;
+  }
 
-void ddhcp_block_free(ddhcp_config* config) {
-  ddhcp_block* block = config->blocks;
+  config->epoch = clock_now();
+  timer_wheel_init(&config->timers, config->epoch);
 
-  for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-    block_free(block++);
+  for (int state = 0; state < DDHCP_BLOCK_STATES; state++) {
+    INIT_LIST_HEAD(&config->block_lists[state]);
+    config->num_blocks[state] = 0;
   }
 
-  block_free_claims(config);
-  free(config->blocks);
+  // Keep lease storage for the spare blocks and the one being filled up
+  // preallocated, and as many released arrays again for reuse.
+  uint32_t lease_chunks = config->spare_blocks_needed + 1;
+
+  if (slab_init(&config->lease_slab, block_lease_storage_size(config->block_size), lease_chunks, lease_chunks)) {
+    FATAL("ddhcp_block_init(...)-> Can't allocate memory for lease slab\n");
+    client_table_free(&config->clients);
+    block_index_free(config);
+    block_table_free(config);
+    return 1;
+  }
+
+  return 0;
+}
+
+void ddhcp_block_free(ddhcp_config* config) {
+  block_table_free(config);
+  block_index_free(config);
+  client_table_free(&config->clients);
+  slab_free(&config->lease_slab);
 }
 
 void ddhcp_block_process(uint8_t* buffer, int len, struct sockaddr_in6 sender, ddhcp_config* config) {
@@ -58,8 +74,11 @@ void ddhcp_block_process(uint8_t* buffer, int len, struct sockaddr_in6 sender, d
   packet.sender = &sender;
 
   if (ret == 0) {
+    peer_seen(&packet, config);
+
     switch (packet.command) {
     case DDHCP_MSG_UPDATECLAIM:
+    case DDHCP_MSG_UPDATECLAIM_RANGES:
       ddhcp_block_process_claims(&packet, config);
       break;
 
@@ -80,38 +99,61 @@ void ddhcp_block_process(uint8_t* buffer, int len, struct sockaddr_in6 sender, d
 
 void ddhcp_block_process_claims(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
   DEBUG("ddhcp_block_process_claims(packet, config )\n");
-  assert(packet->command == 1);
-  time_t now = time(NULL);
+  assert(packet->command == DDHCP_MSG_UPDATECLAIM || packet->command == DDHCP_MSG_UPDATECLAIM_RANGES);
+  time_t now = clock_now();
+  uint32_t blocks = 0;
 
-  ddhcp_block* blocks = config->blocks;
+  for (unsigned int i = 0; i < packet->count; i++) {
+    blocks += packet->payload[i].length;
+  }
+
+  // Every claimed block is materialized, a single range must not fill the table.
+  if (blocks > DDHCP_CLAIM_MAX_BLOCKS) {
+    WARNING("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims %u blocks at once, dropped\n", HEX_NODE_ID(packet->node_id), blocks);
+    config->block_messages.oversized++;
+    return;
+  }
 
   for (unsigned int i = 0; i < packet->count; i++) {
     struct ddhcp_payload* claim = &packet->payload[i];
-    uint32_t block_index = claim->block_index;
 
-    if (block_index >= config->number_of_blocks) {
-      WARNING("ddhcp_block_process_claims(...): Malformed block number\n");
-      continue;
-    }
+    for (uint32_t j = 0; j < claim->length; j++) {
+      uint32_t block_index = claim->block_index + j;
 
-    if (blocks[block_index].state == DDHCP_OURS) {
-      INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims our block %i\n", HEX_NODE_ID(packet->node_id), block_index);
-      // TODO Decide when and if we reclaim this block
-      //      Which node has more leases in this block, ..., who has the better node_id.
-    } else {
-      // Notice the ownership
-      blocks[block_index].state = DDHCP_CLAIMED;
-      blocks[block_index].timeout = now + claim->timeout;
-      // Save the connection details for the claiming node
-      // We need to contact him, for dhcp forwarding actions.
-      memcpy(&blocks[block_index].owner_address, &packet->sender->sin6_addr, sizeof(struct in6_addr));
-      memcpy(&blocks[block_index].node_id, &packet->node_id, sizeof(ddhcp_node_id));
+      if (block_index < claim->block_index || block_index >= config->number_of_blocks) {
+        WARNING("ddhcp_block_process_claims(...): Malformed block number\n");
+        break;
+      }
+
+      ddhcp_block* block = block_materialize(block_index, config);
+
+      if (block == NULL) {
+        continue;
+      }
+
+      if (BLOCK_STATE(block) == DDHCP_OURS) {
+        INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims our block %i\n", HEX_NODE_ID(packet->node_id), block_index);
+        // TODO Decide when and if we reclaim this block
+        //      Which node has more leases in this block, ..., who has the better node_id.
+      } else {
+        if (BLOCK_STATE(block) == DDHCP_CLAIMING) {
+          block_claim_collision(block, config);
+        }
+
+        // Notice the ownership
+        block_set_state(block, DDHCP_CLAIMED, config);
+        block_set_timeout(block, now + claim->timeout, config);
+        // Save the connection details for the claiming node
+        // We need to contact him, for dhcp forwarding actions.
+        memcpy(&block->owner_address, &packet->sender->sin6_addr, sizeof(struct in6_addr));
+        memcpy(&block->node_id, &packet->node_id, sizeof(ddhcp_node_id));
 #if LOG_LEVEL >= LOG_DEBUG
-      char ipv6_sender[INET6_ADDRSTRLEN];
-      DEBUG("Register block to %s\n",
-            inet_ntop(AF_INET6, &blocks[block_index].owner_address, ipv6_sender, INET6_ADDRSTRLEN));
+        char ipv6_sender[INET6_ADDRSTRLEN];
+        DEBUG("Register block to %s\n",
+              inet_ntop(AF_INET6, &block->owner_address, ipv6_sender, INET6_ADDRSTRLEN));
 #endif
-      INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims block %i with ttl: %i\n", HEX_NODE_ID(packet->node_id), block_index, claim->timeout);
+        INFO("ddhcp_block_process_claims(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x claims block %i with ttl: %i\n", HEX_NODE_ID(packet->node_id), block_index, claim->timeout);
+      }
     }
   }
 }
@@ -119,8 +161,7 @@ void ddhcp_block_process_claims(struct ddhcp_mcast_packet* packet, ddhcp_config*
 void ddhcp_block_process_inquire(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
   DEBUG("ddhcp_block_process_inquire( blocks, packet, config )\n");
   assert(packet->command == 2);
-  time_t now = time(NULL);
-  ddhcp_block* blocks = config->blocks;
+  time_t now = clock_now();
 
   for (unsigned int i = 0; i < packet->count; i++) {
     struct ddhcp_payload* tmp = &packet->payload[i];
@@ -132,26 +173,35 @@ void ddhcp_block_process_inquire(struct ddhcp_mcast_packet* packet, ddhcp_config
 
     INFO("ddhcp_block_process_inquire(...): node 0x%02x%02x%02x%02x%02x%02x%02x%02x inquires block %i\n", HEX_NODE_ID(packet->node_id), tmp->block_index);
 
-    if (blocks[tmp->block_index].state == DDHCP_OURS) {
+    ddhcp_block* block = block_materialize(tmp->block_index, config);
+
+    if (block == NULL) {
+      continue;
+    }
+
+    if (BLOCK_STATE(block) == DDHCP_OURS) {
       // Update Claims
       INFO("ddhcp_block_process_inquire(...): block %i is ours notify network", tmp->block_index);
-      blocks[tmp->block_index].timeout = 0;
+      block_set_timeout(block, 0, config);
       block_update_claims(0, config);
-    } else if (blocks[tmp->block_index].state == DDHCP_CLAIMING) {
+    } else if (BLOCK_STATE(block) == DDHCP_CLAIMING) {
       INFO("ddhcp_block_process_inquire(...): we are interested in block %i also\n", tmp->block_index);
 
       // QUESTION Why do we need multiple states for the same process?
       if (NODE_ID_CMP(packet->node_id, config->node_id) > 0) {
         INFO("ddhcp_block_process_inquire(...): .. but other node wins.\n");
-        blocks[tmp->block_index].state = DDHCP_TENTATIVE;
-        blocks[tmp->block_index].timeout = now + config->tentative_timeout;
+        block_set_state(block, DDHCP_TENTATIVE, config);
+        block_set_timeout(block, now + config->tentative_timeout, config);
+        block_claim_collision(block, config);
+      } else {
+        config->collisions_won++;
       }
 
       // otherwise keep inquiring, the other node should see our inquires and step back.
     } else {
       INFO("ddhcp_block_process_inquire(...): set block %i to tentative \n", tmp->block_index);
-      blocks[tmp->block_index].state = DDHCP_TENTATIVE;
-      blocks[tmp->block_index].timeout = now + config->tentative_timeout;
+      block_set_state(block, DDHCP_TENTATIVE, config);
+      block_set_timeout(block, now + config->tentative_timeout, config);
     }
   }
 }
@@ -213,7 +263,7 @@ void ddhcp_dhcp_renewlease(struct ddhcp_mcast_packet* packet, ddhcp_config* conf
 
   answer->renew_payload = packet->renew_payload;
 
-  send_packet_direct(answer, &packet->sender->sin6_addr, config->server_socket, config->mcast_scope_id);
+  send_packet_direct(answer, &packet->sender->sin6_addr, &config->server_queue, config->mcast_scope_id);
   free(answer->renew_payload);
   free(answer);
 }
@@ -233,7 +283,7 @@ void ddhcp_dhcp_leaseack(struct ddhcp_mcast_packet* request, ddhcp_config* confi
     DEBUG("ddhcp_dhcp_leaseack( ... ) -> No matching packet found, ignore message\n");
   } else {
     // Process packet
-    dhcp_rhdl_ack(config->client_socket, packet, config);
+    dhcp_rhdl_ack(&config->client_queue, packet, config);
   }
 
   dhcp_packet_free(packet, 1);
@@ -256,7 +306,7 @@ void ddhcp_dhcp_leasenak(struct ddhcp_mcast_packet* request, ddhcp_config* confi
     DEBUG("ddhcp_dhcp_leaseack( ... ) -> No matching packet found, ignore message\n");
   } else {
     // Process packet
-    dhcp_nack(config->client_socket, packet);
+    dhcp_nack(&config->client_queue, packet, config);
   }
 
   dhcp_packet_free(packet, 1);
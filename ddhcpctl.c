@@ -27,7 +27,7 @@ int main(int argc, char** argv) {
 #define BUFSIZE_MAX 1500
   uint8_t* buffer = (uint8_t*) calloc(sizeof(uint8_t), BUFSIZE_MAX);
 
-  while ((c = getopt(argc, argv, "C:t:l:bdho:r:")) != -1) {
+  while ((c = getopt(argc, argv, "C:t:l:bdho:r:s")) != -1) {
     switch (c) {
     case 'h':
       show_usage = 1;
@@ -45,6 +45,12 @@ int main(int argc, char** argv) {
       buffer[0] = (char) DDHCPCTL_DHCP_OPTIONS_SHOW;
       break;
 
+    case 's':
+      // show statistics
+      msglen = 1;
+      buffer[0] = (char) DDHCPCTL_STATS_SHOW;
+      break;
+
     case 'o':
       option = parse_option();
       break;
@@ -59,7 +65,7 @@ int main(int argc, char** argv) {
       break;
 
     case 'r':
-      msglen = 1;
+      msglen = 2;
       buffer[0] = (char) DDHCPCTL_DHCP_OPTION_REMOVE;
       buffer[1] = (char) atoi(optarg);
       break;
@@ -82,16 +88,18 @@ int main(int argc, char** argv) {
     buffer[0] = (char) 3;
     buffer[1] = (char) option->code;
     buffer[2] = (char) option->len;
-    memcpy(buffer + 3, option->payload, sizeof(option));
+    memcpy(buffer + 3, option->payload, option->len);
+    free(option->payload);
     free(option);
   }
 
   if (show_usage) {
-    printf("Usage: ddhcpctl [-h|-b|-d|-o <option>|-C PATH]\n");
+    printf("Usage: ddhcpctl [-h|-b|-d|-s|-o <option>|-C PATH]\n");
     printf("\n");
     printf("-h                     This usage information.\n");
     printf("-b                     Show current block usage.\n");
     printf("-d                     Show the current dhcp options store.\n");
+    printf("-s                     Show statistics of the daemon.\n");
     printf("-l                     Set the dhcp lease time.\n");
     printf("-o CODE:LEN:P1. .. .Pn Set DHCP Option with code,len and #len chars in decimal\n");
     printf("-r CODE                Remove DHCP Option");
@@ -1,10 +1,18 @@
+#include <assert.h>
+#include <errno.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
 #include <string.h>
 
 #include "block.h"
+#include "client.h"
+#include "clock.h"
 #include "dhcp.h"
 #include "dhcp_options.h"
 #include "logger.h"
+#include "netsock.h"
 #include "packet.h"
+#include "scan.h"
 #include "tools.h"
 #include "hook.h"
 
@@ -14,7 +22,7 @@ uint16_t DHCP_LEASE_SERVER_DELTA = 10;
 
 #if LOG_LEVEL >= LOG_DEBUG
 #define DEBUG_DHCP_LEASE(...) do { \
-  DEBUG("DHCP LEASE [ state %i, xid %u, end %i ]\n",lease->state,lease->xid,lease->lease_end);\
+  DEBUG("DHCP LEASE [ xid %u, end %u ]\n",lease->xid,lease->lease_end);\
 } while (0);
 #else
 #define DEBUG_LEASE(...)
@@ -26,22 +34,25 @@ uint16_t DHCP_LEASE_SERVER_DELTA = 10;
  * A status code of 0 is returned, iff the result is in one of our blocks.
  * Of 1, iff result is non in our blocks.
  * And 2 on failure.
+ * Blocks which are not materialized are FREE, for them lease_block is set
+ * to null.
  */
 uint8_t find_lease_from_address(struct in_addr* addr, ddhcp_config* config, ddhcp_block** lease_block, uint32_t* lease_index) {
 #if LOG_LEVEL >= LOG_DEBUG
   DEBUG("find_lease_from_address( %s, ...)\n", inet_ntoa(*addr));
 #endif
-  ddhcp_block* blocks = config->blocks;
   uint32_t address = (uint32_t) addr->s_addr;
 
   uint32_t block_number = (ntohl(address) - ntohl((uint32_t) config->prefix.s_addr)) / config->block_size;
   uint32_t lease_number = (ntohl(address) - ntohl((uint32_t) config->prefix.s_addr)) % config->block_size;
 
   if (block_number < config->number_of_blocks) {
-    DEBUG("find_lease_from_address(...) -> found block %i and lease %i with state %i \n", block_number, lease_number, blocks[block_number].state);
+    ddhcp_block* block = block_lookup(block_number, config);
+    enum ddhcp_block_state state = block_state(block_number, config);
+    DEBUG("find_lease_from_address(...) -> found block %i and lease %i with state %i \n", block_number, lease_number, state);
 
     if (lease_block) {
-      *lease_block = blocks + block_number;
+      *lease_block = block;
     }
 
     if (lease_index) {
@@ -50,7 +61,7 @@ uint8_t find_lease_from_address(struct in_addr* addr, ddhcp_config* config, ddhc
 
     DEBUG("find_lease_from_address( ... ): state: %i\n", DDHCP_OURS);
 
-    if (blocks[block_number].state == DDHCP_OURS) {
+    if (state == DDHCP_OURS) {
       return 0;
     } else {
       // TODO Try to aquire address for client
@@ -63,16 +74,53 @@ uint8_t find_lease_from_address(struct in_addr* addr, ddhcp_config* config, ddhc
   return 2;
 }
 
-void _dhcp_release_lease(ddhcp_block* block , uint32_t lease_index) {
+time_t dhcp_lease_end(dhcp_lease* lease, ddhcp_config* config) {
+  return config->epoch + lease->lease_end;
+}
+
+void dhcp_lease_set_end(dhcp_lease* lease, time_t lease_end, ddhcp_config* config) {
+  lease->lease_end = lease_end > config->epoch ? (uint32_t) (lease_end - config->epoch) : 0;
+}
+
+void _dhcp_lease_set_state(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, ddhcp_config* config) {
+  uint8_t old = block->lease_states[lease_index];
+  block->num_leases[old]--;
+  block->num_leases[state]++;
+
+  if (BLOCK_STATE(block) == DDHCP_OURS) {
+    config->num_leases[old]--;
+    config->num_leases[state]++;
+
+    uint8_t* hwaddr = block->addresses[lease_index].hwaddr;
+    uint32_t offset = block->index * config->block_size + lease_index;
+
+    if (state == FREE) {
+      client_table_del(&config->clients, hwaddr, offset);
+    } else if (client_table_set(&config->clients, hwaddr, offset)) {
+      ERROR("_dhcp_lease_set_state(...): client of lease %i in block %i not indexed\n", lease_index, block->index);
+    }
+  }
+
+  uint64_t* free_word = block->lease_free + lease_index / 64;
+  uint64_t* offered_word = block->lease_offered + lease_index / 64;
+  uint64_t bit = 1ULL << (lease_index % 64);
+
+  block->lease_states[lease_index] = state;
+  *free_word = state == FREE ? *free_word | bit : *free_word & ~bit;
+  *offered_word = state == OFFERED ? *offered_word | bit : *offered_word & ~bit;
+}
+
+void _dhcp_release_lease(ddhcp_block* block , uint32_t lease_index, ddhcp_config* config) {
   INFO("Releasing Lease %i in block %i\n", lease_index, block->index);
   dhcp_lease* lease = block->addresses + lease_index;
 
+  _dhcp_lease_set_state(block, lease_index, FREE, config);
+
   // TODO Should we really reset the chaddr or xid, RFC says we
   // ''SHOULD retain a record of the client's initialization parameters for possible reuse''
-  memset(lease->chaddr, 0, 16);
+  HWADDR_CLEAR(lease->hwaddr);
 
   lease->xid   = 0;
-  lease->state = FREE;
 }
 
 dhcp_packet* build_initial_packet(dhcp_packet* from_client) {
@@ -96,6 +144,7 @@ dhcp_packet* build_initial_packet(dhcp_packet* from_client) {
   // yiaddr
   // siaddr
   memcpy(&packet->giaddr, &from_client->giaddr, 4);
+  packet->relay = from_client->relay;
   memcpy(&packet->chaddr, &from_client->chaddr, 16);
   // sname
   // file
@@ -104,26 +153,201 @@ dhcp_packet* build_initial_packet(dhcp_packet* from_client) {
   return packet;
 }
 
-uint8_t _ddo[1] = { 0 };
+uint32_t _dhcp_reply_hash(uint8_t msg_type, uint8_t* prl, uint8_t prl_len) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  hash = (hash ^ msg_type) * 16777619u;
+
+  for (int i = 0; i < prl_len; i++) {
+    hash = (hash ^ prl[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+dhcp_reply_template* _dhcp_reply_template(uint8_t msg_type, dhcp_packet* request, ddhcp_config* config) {
+  uint8_t* prl = NULL;
+  uint8_t prl_len = find_option_parameter_request_list(request, &prl);
+  uint32_t hash = _dhcp_reply_hash(msg_type, prl, prl_len);
+  dhcp_reply_template* template = config->reply_templates + hash % DHCP_REPLY_TEMPLATES;
+
+  if (template->len > 0
+      && template->msg_type == msg_type
+      && template->generation == config->options.generation
+      && template->prl_len == prl_len
+      && (prl_len == 0 || memcmp(template->prl, prl, prl_len) == 0)) {
+    config->reply_template_hits++;
+    return template;
+  }
+
+  DEBUG("_dhcp_reply_template(...) -> build template for message type %i\n", msg_type);
+  config->reply_template_misses++;
+
+  // Only the message type and options are part of the template, the fields
+  // depending on the request are patched in by _dhcp_reply.
+  dhcp_packet packet;
+  uint8_t options[DHCP_OPTIONS_MAX_LEN];
+  memset(&packet, 0, sizeof(dhcp_packet));
+  packet.op = 2;
+  packet.option_data = options;
+  packet.option_data_len = encode_reply_options(msg_type, request, &config->options, options, DHCP_OPTIONS_MAX_LEN);
+
+  template->msg_type = msg_type;
+  template->generation = config->options.generation;
+  template->prl_len = prl_len;
+
+  if (prl_len > 0) {
+    memcpy(template->prl, prl, prl_len);
+  }
+
+  template->len = hton_dhcp_packet(&packet, template->image);
+
+  return template;
+}
+
+/**
+ * Find the counters of the relay agent at address, start counting for a
+ * new relay while there is room. Returns NULL otherwise.
+ */
+dhcp_relay* _dhcp_relay(struct in_addr* address, ddhcp_config* config) {
+  for (uint32_t i = 0; i < config->relays_len; i++) {
+    if (config->relays[i].address.s_addr == address->s_addr) {
+      return config->relays + i;
+    }
+  }
+
+  if (config->relays_len == DHCP_RELAYS) {
+    config->relay_untracked++;
+    return NULL;
+  }
+
+  dhcp_relay* relay = config->relays + config->relays_len++;
+  memset(relay, 0, sizeof(dhcp_relay));
+  relay->address = *address;
+  return relay;
+}
+
+/**
+ * Check whether we serve the segment of a relay agent, that is whether
+ * its address lies in our prefix. Only accepted relays are counted, their
+ * counters are kept in request->relay for the reply.
+ */
+int _dhcp_relay_accept(dhcp_packet* request, ddhcp_config* config) {
+  uint32_t offset = ntohl(request->giaddr.s_addr) - ntohl(config->prefix.s_addr);
+
+  if (offset >= config->block_size * config->number_of_blocks) {
+    DEBUG("_dhcp_relay_accept(...): relay %s is not in our prefix\n", inet_ntoa(request->giaddr));
+    config->relay_rejected++;
+    return 0;
+  }
+
+  request->relay = _dhcp_relay(&request->giaddr, config);
+
+  if (request->relay != NULL) {
+    request->relay->requests++;
+  }
+
+  return 1;
+}
+
+void _dhcp_relay_destination(dhcp_packet* request, struct sockaddr_in* dest, ddhcp_config* config) {
+  if (request->relay != NULL) {
+    request->relay->replies++;
+  }
+
+  dest->sin_addr = request->giaddr;
+  dest->sin_port = htons(config->dhcp_port);
+}
+
+/**
+ * Choose where to send a reply, following RFC 2131 4.1: To the relay agent
+ * the request came through, to a client which already has an address at
+ * ciaddr, broadcast if the client asked for it, otherwise to the hardware
+ * address of the client at yiaddr.
+ */
+void _dhcp_reply_destination(ddhcp_send_queue* queue, dhcp_packet* request, struct in_addr* yiaddr, struct sockaddr_in* dest, ddhcp_config* config) {
+  dest->sin_family = AF_INET;
+  dest->sin_port = htons(68);
+
+  if (request->giaddr.s_addr != INADDR_ANY) {
+    _dhcp_relay_destination(request, dest, config);
+    return;
+  }
+
+  if (request->ciaddr.s_addr != INADDR_ANY) {
+    config->unicast_replies++;
+    dest->sin_addr = request->ciaddr;
+    return;
+  }
+
+  dest->sin_addr.s_addr = INADDR_BROADCAST;
+
+  if (request->flags & DHCP_FLAG_BROADCAST) {
+    config->broadcast_replies++;
+    return;
+  }
+
+  // The client does not answer ARP requests for yiaddr yet.
+  if (netsock_neigh_add(queue->socket, yiaddr, (uint8_t*) request->chaddr, config) < 0) {
+    DEBUG("_dhcp_reply_destination(...): Unable to add neighbour entry, %s\n", strerror(errno));
+    config->broadcast_replies++;
+    return;
+  }
+
+  config->unicast_replies++;
+  dest->sin_addr = *yiaddr;
+}
+
+int _dhcp_reply(ddhcp_send_queue* queue, uint8_t msg_type, dhcp_packet* request, struct in_addr* yiaddr, ddhcp_config* config) {
+  dhcp_reply_template* template = _dhcp_reply_template(msg_type, request, config);
+  uint8_t* image = template->image;
+  uint16_t tmp16;
+  uint32_t tmp32;
+
+  image[1] = request->htype;
+  image[2] = request->hlen;
+  image[3] = request->hops;
+  tmp32 = htonl(request->xid);
+  memcpy(image + 4, &tmp32, 4);
+  tmp16 = htons(request->flags);
+  memcpy(image + 10, &tmp16, 2);
+  memcpy(image + 12, &request->ciaddr, 4);
+  memcpy(image + 16, yiaddr, 4);
+  memcpy(image + 24, &request->giaddr, 4);
+  memcpy(image + 28, &request->chaddr, 16);
+
+  struct sockaddr_in dest;
+  _dhcp_reply_destination(queue, request, yiaddr, &dest, config);
+  return dhcp_packet_send_buffer(queue, image, template->len, &dest);
+}
 
-void _dhcp_default_options(uint8_t msg_type, dhcp_packet* packet, dhcp_packet* request, ddhcp_config* config) {
-  // TODO We need a more extendable way to build up options
-  // TODO Proper error handling
+void dhcp_reply_show_status(int fd, ddhcp_config* config) {
+  uint32_t used = 0;
 
-  // Fill options list with requested options, allocate memory and reserve for additonal
-  // dhcp options.
-  packet->options_len = fill_options(request->options, request->options_len, &config->options, 3, &packet->options) ;
+  for (int i = 0; i < DHCP_REPLY_TEMPLATES; i++) {
+    if (config->reply_templates[i].len > 0 && config->reply_templates[i].generation == config->options.generation) {
+      used++;
+    }
+  }
 
-  // DHCP Message Type
-  _ddo[0] = msg_type;
-  set_option(packet->options, packet->options_len, DHCP_CODE_MESSAGE_TYPE, 1, _ddo);
+  dprintf(fd, "reply templates\n");
+  dprintf(fd, "      valid\t%u/%u\n", used, DHCP_REPLY_TEMPLATES);
+  dprintf(fd, "      hits/misses\t%lu/%lu\n", (unsigned long) config->reply_template_hits, (unsigned long) config->reply_template_misses);
+  dprintf(fd, "      unicast/broadcast\t%lu/%lu\n", (unsigned long) config->unicast_replies, (unsigned long) config->broadcast_replies);
+  dprintf(fd, "      non ethernet requests\t%lu\n", (unsigned long) config->non_ethernet_requests);
+}
 
-  // DHCP Lease Time
-  set_option_from_store(&config->options, packet->options, packet->options_len, DHCP_CODE_ADDRESS_LEASE_TIME);
+void dhcp_relay_show_status(int fd, ddhcp_config* config) {
+  dprintf(fd, "relays\n");
+  dprintf(fd, "address\trequests\treplies\n");
 
-  // DHCP Server identifier
-  set_option_from_store(&config->options, packet->options, packet->options_len, DHCP_CODE_SERVER_IDENTIFIER);
+  for (uint32_t i = 0; i < config->relays_len; i++) {
+    dhcp_relay* relay = config->relays + i;
+    dprintf(fd, "%s\t%lu\t%lu\n", inet_ntoa(relay->address), (unsigned long) relay->requests, (unsigned long) relay->replies);
+  }
 
+  dprintf(fd, "      untracked requests\t%lu\n", (unsigned long) config->relay_untracked);
+  dprintf(fd, "      rejected requests\t%lu\n", (unsigned long) config->relay_rejected);
 }
 
 int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config) {
@@ -131,12 +355,23 @@ int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config) {
   struct dhcp_packet dhcp_packet;
   int ret = ntoh_dhcp_packet(&dhcp_packet, buffer, len);
 
+  // Leases and the client table keep ethernet addresses only.
+  if (ret == 0 && (dhcp_packet.htype != ARPHRD_ETHER || dhcp_packet.hlen != ETH_ALEN)) {
+    DEBUG("dhcp_process(...): Ignore client with hardware type %i and address length %i\n", dhcp_packet.htype, dhcp_packet.hlen);
+    config->non_ethernet_requests++;
+    return 0;
+  }
+
+  if (ret == 0 && dhcp_packet.giaddr.s_addr != INADDR_ANY && !_dhcp_relay_accept(&dhcp_packet, config)) {
+    return 0;
+  }
+
   if (ret == 0) {
     int message_type = dhcp_packet_message_type(&dhcp_packet);
 
     switch (message_type) {
     case DHCPDISCOVER:
-      ret = dhcp_hdl_discover(config->client_socket, &dhcp_packet, config);
+      ret = dhcp_hdl_discover(&config->client_queue, &dhcp_packet, config);
 
       if (ret == 1) {
         INFO("we need to inquire new blocks\n");
@@ -146,7 +381,7 @@ int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config) {
       break;
 
     case DHCPREQUEST:
-      dhcp_hdl_request(config->client_socket, &dhcp_packet, config);
+      dhcp_hdl_request(&config->client_queue, &dhcp_packet, config);
       break;
 
     case DHCPRELEASE:
@@ -157,10 +392,6 @@ int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config) {
       WARNING("Unknown DHCP message of type: %i\n", message_type);
       break;
     }
-
-    if (dhcp_packet.options_len > 0) {
-      free(dhcp_packet.options);
-    }
   } else {
     WARNING("Malformed packet!? errcode: %i\n", ret);
   }
@@ -168,11 +399,19 @@ int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config) {
   return 0;
 }
 
-int dhcp_hdl_discover(int socket, dhcp_packet* discover, ddhcp_config* config) {
-  DEBUG("dhcp_discover( %i, packet, blocks, config)\n", socket);
+int dhcp_hdl_discover(ddhcp_send_queue* queue, dhcp_packet* discover, ddhcp_config* config) {
+  DEBUG("dhcp_discover( %i, packet, blocks, config)\n", queue->socket);
 
-  time_t now = time(NULL);
-  ddhcp_block* lease_block = block_find_free_leases(config);
+  time_t now = clock_now();
+  ddhcp_block* lease_block;
+
+  if (discover->giaddr.s_addr != INADDR_ANY) {
+    // Offer an address of the segment of the relay agent, or close to it.
+    uint32_t origin = (ntohl(discover->giaddr.s_addr) - ntohl(config->prefix.s_addr)) / config->block_size;
+    lease_block = block_find_free_leases_near(origin, config);
+  } else {
+    lease_block = block_find_free_leases(config);
+  }
 
   if (lease_block == NULL) {
     DEBUG("dhcp_discover( ... ) -> no block with free leases found\n");
@@ -187,29 +426,19 @@ int dhcp_hdl_discover(int socket, dhcp_packet* discover, ddhcp_config* config) {
     return 2;
   }
 
-  dhcp_packet* packet = build_initial_packet(discover);
-
-  if (packet == NULL) {
-    DEBUG("dhcp_discover(...) -> memory allocation failure");
-    return 1;
-  }
-
   // Mark lease as offered and register client
-  memcpy(&lease->chaddr, &discover->chaddr, 16);
+  HWADDR_CP(lease->hwaddr, discover->chaddr);
   lease->xid = discover->xid;
-  lease->state = OFFERED;
-  lease->lease_end = now + DHCP_OFFER_TIMEOUT;
+  _dhcp_lease_set_state(lease_block, lease_index, OFFERED, config);
+  dhcp_lease_set_end(lease, now + DHCP_OFFER_TIMEOUT, config);
+  block_schedule_lease_timeout(lease_block, dhcp_lease_end(lease, config), config);
 
-  addr_add(&lease_block->subnet, &packet->yiaddr, lease_index);
+  struct in_addr yiaddr;
+  addr_add(&lease_block->subnet, &yiaddr, lease_index);
 
   DEBUG("dhcp_discover(...) offering address %i %s\n", lease_index, inet_ntoa(lease_block->subnet));
 
-  _dhcp_default_options(DHCPOFFER,packet,discover,config);
-
-  dhcp_packet_send(socket, packet);
-
-  free(packet->options);
-  free(packet);
+  _dhcp_reply(queue, DHCPOFFER, discover, &yiaddr, config);
 
   return 0;
 }
@@ -217,7 +446,7 @@ int dhcp_hdl_discover(int socket, dhcp_packet* discover, ddhcp_config* config) {
 int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config) {
   DEBUG("dhcp_rhdl_request(address, blocks, config)\n");
 
-  time_t now = time(NULL);
+  time_t now = clock_now();
   ddhcp_block* lease_block = NULL;
   uint32_t lease_index = 0;
   struct in_addr requested_address;
@@ -230,7 +459,8 @@ int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config) {
     // Update lease information
     // TODO Check for validity of request (chaddr)
     dhcp_lease* lease = lease_block->addresses + lease_index;
-    lease->lease_end = now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA;
+    dhcp_lease_set_end(lease, now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA, config);
+    block_schedule_lease_timeout(lease_block, dhcp_lease_end(lease, config), config);
     // Report ack
     return 0;
   } else if (found == 1) {
@@ -242,13 +472,13 @@ int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config) {
   }
 }
 
-int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhcp_config* config) {
+int dhcp_rhdl_ack(ddhcp_send_queue* queue, struct dhcp_packet* request, ddhcp_config* config) {
 
   ddhcp_block* lease_block = NULL;
   uint32_t lease_index = 0;
   struct in_addr requested_address;
 
-  uint8_t* address = find_option_requested_address(request->options, request->options_len);
+  uint8_t* address = find_option_requested_address(request);
 
   if (address) {
     memcpy(&requested_address, address, sizeof(struct in_addr));
@@ -256,25 +486,67 @@ int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhcp_config* config)
     memcpy(&requested_address, &request->ciaddr.s_addr, sizeof(struct in_addr));
   }
 
-  if (find_lease_from_address(&requested_address, config, &lease_block, &lease_index) != 1) {
+  if (find_lease_from_address(&requested_address, config, &lease_block, &lease_index) != 1 || lease_block == NULL || lease_block->addresses == NULL) {
     DEBUG("dhcp_rhdl_ack( ... ) -> lease not found\n");
     return 1;
   }
 
-  return dhcp_ack(socket, request, lease_block, lease_index, config);
+  return dhcp_ack(queue, request, lease_block, lease_index, config);
+}
+
+/**
+ * Search our blocks for the lease offered to the client of request.
+ * Only needed for clients which could not be registered in the client table.
+ */
+ddhcp_block* _dhcp_find_offered(dhcp_packet* request, uint32_t* lease_index, ddhcp_config* config) {
+  ddhcp_block* block;
+
+  list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+    for (uint32_t w = 0; w < DHCP_LEASE_WORDS(block->subnet_len); w++) {
+      for (uint64_t offered = block->lease_offered[w]; offered; offered &= offered - 1) {
+        uint32_t i = w * 64 + __builtin_ctzll(offered);
+
+        if (block->addresses[i].xid == request->xid && HWADDR_CMP(block->addresses[i].hwaddr, request->chaddr) == 0) {
+          *lease_index = i;
+          return block;
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+void dhcp_client_table_rebuild(ddhcp_config* config) {
+  ddhcp_block* block;
+
+  list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+    for (uint32_t i = 0; i < block->subnet_len; i++) {
+      if (block->lease_states[i] == FREE) {
+        continue;
+      }
+
+      if (client_table_set(&config->clients, block->addresses[i].hwaddr, block->index * config->block_size + i)) {
+        return;
+      }
+    }
+  }
+
+  INFO("dhcp_client_table_rebuild(...): %u unindexed clients registered again\n", config->clients.unindexed);
+  config->clients.unindexed = 0;
 }
 
-int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* config) {
-  DEBUG("dhcp_hdl_request( %i, dhcp_packet, blocks, config)\n", socket);
+int dhcp_hdl_request(ddhcp_send_queue* queue, struct dhcp_packet* request, ddhcp_config* config) {
+  DEBUG("dhcp_hdl_request( %i, dhcp_packet, blocks, config)\n", queue->socket);
 
   // search the lease we may have offered
 
-  time_t now = time(NULL);
+  time_t now = clock_now();
   dhcp_lease* lease = NULL ;
   ddhcp_block* lease_block = NULL;
   uint32_t lease_index = 0;
 
-  uint8_t* address = find_option_requested_address(request->options, request->options_len);
+  uint8_t* address = find_option_requested_address(request);
 
   struct in_addr requested_address;
   uint8_t found_address = 0;
@@ -292,14 +564,19 @@ int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* conf
     uint8_t found = find_lease_from_address(&requested_address, config, &lease_block, &lease_index);
 
     if (found != 2) {
+      if (lease_block == NULL) {
+        // Block is not materialized and therefore FREE, handle it like any other not owned block.
+        return 2;
+      }
+
       lease = lease_block->addresses + lease_index;
       DEBUG("dhcp_hdl_request(...): Lease found.\n");
 
-      if (lease_block->state == DDHCP_CLAIMED) {
+      if (BLOCK_STATE(lease_block) == DDHCP_CLAIMED) {
         if (lease_block->addresses == NULL) {
-          if (block_alloc(lease_block)) {
+          if (block_alloc(lease_block, config)) {
             ERROR("dhcp_hdl_request(...): can't allocate requested block");
-            dhcp_nack(socket, request);
+            dhcp_nack(queue, request, config);
           }
         }
 
@@ -309,9 +586,10 @@ int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* conf
         // Register client information in lease
         // TODO This isn't a good idea, because of multi request on the same address from various clients, register it elsewhere and append xid.
         lease->xid = request->xid;
-        lease->state = OFFERED;
-        lease->lease_end = now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA;
-        memcpy(&lease->chaddr, &request->chaddr, 16);
+        _dhcp_lease_set_state(lease_block, lease_index, OFFERED, config);
+        dhcp_lease_set_end(lease, now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA, config);
+        block_schedule_lease_timeout(lease_block, dhcp_lease_end(lease, config), config);
+        HWADDR_CP(lease->hwaddr, request->chaddr);
 
         // Build packet and send it
         ddhcp_renew_payload payload;
@@ -333,18 +611,20 @@ int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* conf
         // TODO Error handling
         dhcp_packet_list_add(&config->dhcp_packet_cache,request);
 
-        send_packet_direct(packet, &lease_block->owner_address, config->server_socket, config->mcast_scope_id);
+        send_packet_direct(packet, &lease_block->owner_address, &config->server_queue, config->mcast_scope_id);
         free(packet);
         return 2;
 
-      } else if (lease_block->state == DDHCP_OURS) {
-        if (lease->state != OFFERED || lease->xid != request->xid) {
-          if (memcmp(request->chaddr, lease->chaddr, 16) != 0) {
+      } else if (BLOCK_STATE(lease_block) == DDHCP_OURS) {
+        uint8_t lease_state = lease_block->lease_states[lease_index];
+
+        if (lease_state != OFFERED || lease->xid != request->xid) {
+          if (HWADDR_CMP(request->chaddr, lease->hwaddr) != 0) {
             // Check if lease is free
-            if (lease->state != FREE) {
+            if (lease_state != FREE) {
               DEBUG("dhcp_request(...): Requested lease offered to other client\n");
               // Send DHCP_NACK
-              dhcp_nack(socket, request);
+              dhcp_nack(queue, request, config);
               return 2;
             }
           }
@@ -356,44 +636,37 @@ int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* conf
       }
     }
   } else {
-    ddhcp_block* block = config->blocks;
-
-    // Find lease from xid
-    for (uint32_t i = 0; i < config->number_of_blocks; i++) {
-      if (block->state == DDHCP_OURS) {
-        dhcp_lease* lease_iter = block->addresses;
-
-        for (unsigned int j = 0 ; j < block->subnet_len ; j++) {
-          if (lease_iter->state == OFFERED && lease_iter->xid == request->xid) {
-            if (memcmp(request->chaddr, lease_iter->chaddr, 16) == 0) {
-              lease = lease_iter;
-              lease_block = block;
-              lease_index = j;
-              DEBUG("dhcp_request(...): Found requested lease\n");
-              break;
-            }
-          }
-
-          lease_iter++;
-        }
-
-        if (lease) {
-          break;
-        }
+    // Find lease from chaddr and xid
+    ddhcp_client* client = client_table_find(&config->clients, (uint8_t*) request->chaddr);
+
+    if (client) {
+      ddhcp_block* block = block_lookup(client->offset / config->block_size, config);
+      uint32_t index = client->offset % config->block_size;
+
+      if (block && BLOCK_STATE(block) == DDHCP_OURS && block->lease_states[index] == OFFERED && block->addresses[index].xid == request->xid) {
+        lease = block->addresses + index;
+        lease_block = block;
+        lease_index = index;
+        DEBUG("dhcp_request(...): Found requested lease\n");
       }
+    } else if (config->clients.unindexed > 0) {
+      lease_block = _dhcp_find_offered(request, &lease_index, config);
 
-      block++;
+      if (lease_block) {
+        lease = lease_block->addresses + lease_index;
+        DEBUG("dhcp_request(...): Found requested lease of unindexed client\n");
+      }
     }
   }
 
   if (lease == NULL) {
     DEBUG("dhcp_request(...): Requested lease not found\n");
     // Send DHCP_NACK
-    dhcp_nack(socket, request);
+    dhcp_nack(queue, request, config);
     return 2;
   }
 
-  return dhcp_ack(socket, request, lease_block, lease_index, config);
+  return dhcp_ack(queue, request, lease_block, lease_index, config);
 }
 
 void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config) {
@@ -412,8 +685,8 @@ void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config) {
     lease = lease_block->addresses + lease_index;
 
     // Check Hardware Address of client
-    if (memcmp(packet->chaddr, lease->chaddr, 16) == 0) {
-      _dhcp_release_lease(lease_block, lease_index);
+    if (HWADDR_CMP(packet->chaddr, lease->hwaddr) == 0) {
+      _dhcp_release_lease(lease_block, lease_index, config);
       hook(HOOK_RELEASE, &packet->yiaddr, (uint8_t*) &packet->chaddr, config);
     } else {
       ERROR("Hardware Adress transmitted by client and our record did not match, do nothing.\n");
@@ -430,7 +703,7 @@ void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config) {
   }
 }
 
-int dhcp_nack(int socket, dhcp_packet* from_client) {
+int dhcp_nack(ddhcp_send_queue* queue, dhcp_packet* from_client, ddhcp_config* config) {
   dhcp_packet* packet = build_initial_packet(from_client);
 
   if (packet == NULL) {
@@ -446,96 +719,87 @@ int dhcp_nack(int socket, dhcp_packet* from_client) {
     DHCPNAK
   });
 
-  dhcp_packet_send(socket, packet);
+  // A NAK is always broadcast, the client might use an address it must not.
+  struct sockaddr_in dest = {
+    .sin_family = AF_INET,
+    .sin_port = htons(68),
+    .sin_addr = { INADDR_BROADCAST },
+  };
+
+  if (packet->giaddr.s_addr != INADDR_ANY) {
+    // Ask the relay agent to broadcast it.
+    packet->flags |= DHCP_FLAG_BROADCAST;
+    _dhcp_relay_destination(packet, &dest, config);
+  }
+
+  dhcp_packet_send(queue, packet, &dest);
   free(packet->options);
   free(packet);
 
   return 0;
 }
 
-int dhcp_ack(int socket, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config) {
-  time_t now = time(NULL);
-  dhcp_packet* packet = build_initial_packet(request);
+int dhcp_ack(ddhcp_send_queue* queue, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config) {
+  time_t now = clock_now();
   dhcp_lease* lease = lease_block->addresses + lease_index;
 
-  if (packet == NULL) {
-    DEBUG("dhcp_request(...) -> memory allocation failure\n");
-    return 1;
-  }
-
   // Mark lease as leased and register client
-  memcpy(&lease->chaddr, &request->chaddr, 16);
+  HWADDR_CP(lease->hwaddr, request->chaddr);
   lease->xid = request->xid;
-  lease->state = LEASED;
-  lease->lease_end = now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA;
-
-  addr_add(&lease_block->subnet, &packet->yiaddr, lease_index);
-  DEBUG("dhcp_ack(...) offering address %i %s\n", lease_index, inet_ntoa(packet->yiaddr));
+  _dhcp_lease_set_state(lease_block, lease_index, LEASED, config);
+  dhcp_lease_set_end(lease, now + find_in_option_store_address_lease_time(&config->options)  + DHCP_LEASE_SERVER_DELTA, config);
+  block_schedule_lease_timeout(lease_block, dhcp_lease_end(lease, config), config);
 
-  _dhcp_default_options(DHCPACK, packet, request, config);
+  struct in_addr yiaddr;
+  addr_add(&lease_block->subnet, &yiaddr, lease_index);
+  DEBUG("dhcp_ack(...) offering address %i %s\n", lease_index, inet_ntoa(yiaddr));
 
-  dhcp_packet_send(socket, packet);
+  _dhcp_reply(queue, DHCPACK, request, &yiaddr, config);
 
-  hook(HOOK_LEASE, &packet->yiaddr, (uint8_t*) &packet->chaddr, config);
+  hook(HOOK_LEASE, &yiaddr, (uint8_t*) &request->chaddr, config);
 
-  free(packet->options);
-  free(packet);
   return 0;
 }
 
 int dhcp_has_free(struct ddhcp_block* block) {
-  dhcp_lease* lease = block->addresses;
-
-  for (unsigned int i = 0; i < block->subnet_len; i++) {
-    if (lease->state == FREE) {
-      return 1;
-    }
-
-    lease++;
-  }
-
-  return 0;
+  return block->num_leases[FREE] > 0;
 }
 
 int dhcp_num_free(struct ddhcp_block* block) {
-  int num = 0;
-  dhcp_lease* lease = block->addresses;
-
-  for (unsigned int i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state == FREE) {
-      num++;
-    }
-
-    lease++;
-  }
-
-  return num;
+  return block->num_leases[FREE];
 }
 
 int dhcp_num_offered(struct ddhcp_block* block) {
-  int num = 0;
-  dhcp_lease* lease = block->addresses;
+  return block->num_leases[OFFERED];
+}
 
-  for (unsigned int i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state == OFFERED) {
-      num++;
-    }
+void dhcp_check_counts(ddhcp_block* block) {
+#ifndef NDEBUG
+  uint32_t num_leases[DHCP_LEASE_STATES] = { 0 };
+  uint32_t num_free = 0;
+  uint32_t num_offered = 0;
+
+  for (uint32_t i = 0; i < block->subnet_len && block->addresses; i++) {
+    num_leases[block->lease_states[i]]++;
+  }
 
-    lease++;
+  for (uint32_t w = 0; w < DHCP_LEASE_WORDS(block->subnet_len) && block->addresses; w++) {
+    num_free += __builtin_popcountll(block->lease_free[w]);
+    num_offered += __builtin_popcountll(block->lease_offered[w]);
   }
 
-  return num;
+  assert(memcmp(num_leases, block->num_leases, sizeof(num_leases)) == 0);
+  assert(num_free == num_leases[FREE] && num_offered == num_leases[OFFERED]);
+#else
+  (void) block;
+#endif
 }
 
 uint32_t dhcp_get_free_lease(ddhcp_block* block) {
-  dhcp_lease* lease = block->addresses;
-
-  for (uint32_t i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state == FREE) {
-      return i;
+  for (uint32_t w = 0; w < DHCP_LEASE_WORDS(block->subnet_len); w++) {
+    if (block->lease_free[w]) {
+      return w * 64 + __builtin_ctzll(block->lease_free[w]);
     }
-
-    lease++;
   }
 
   ERROR("dhcp_get_free_lease(...): no free lease found");
@@ -552,30 +816,32 @@ void dhcp_release_lease(uint32_t address, ddhcp_config* config) {
   uint8_t found = find_lease_from_address(&addr, config, &lease_block, &lease_index);
 
   if (found == 0) {
-    _dhcp_release_lease(lease_block, lease_index);
+    _dhcp_release_lease(lease_block, lease_index, config);
   } else {
     DEBUG("No lease for Address %s found.\n", inet_ntoa(addr));
   }
 }
 
-int dhcp_check_timeouts(ddhcp_block* block) {
+int dhcp_check_timeouts(ddhcp_block* block, ddhcp_config* config) {
   DEBUG("dhcp_check_timeouts(block)\n");
-  dhcp_lease* lease = block->addresses;
-  time_t now = time(NULL);
-
-  int free_leases = 0;
-
-  for (unsigned int i = 0 ; i < block->subnet_len ; i++) {
-    if (lease->state != FREE && lease->lease_end < now) {
-      _dhcp_release_lease(block, i);
-    }
-
-    if (lease->state == FREE) {
-      free_leases++;
+  uint8_t* states = block->lease_states;
+  time_t now = clock_now();
+  time_t next_end = 0;
+
+  for (uint32_t i = scan_find_other(states, block->subnet_len, FREE); i < block->subnet_len;
+       i += 1 + scan_find_other(states + i + 1, block->subnet_len - i - 1, FREE)) {
+    time_t lease_end = dhcp_lease_end(block->addresses + i, config);
+
+    if (lease_end < now) {
+      _dhcp_release_lease(block, i, config);
+    } else if (next_end == 0 || lease_end < next_end) {
+      next_end = lease_end;
     }
+  }
 
-    lease++;
+  if (next_end != 0) {
+    block_schedule_lease_timeout(block, next_end, config);
   }
 
-  return free_leases;
+  return block->num_leases[FREE];
 }
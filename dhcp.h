@@ -9,6 +9,7 @@
 
 /**
  * DHCP Process Packet
+ * Requests of clients without an ethernet hardware address are dropped.
  */
 int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config);
 
@@ -20,13 +21,13 @@ int dhcp_process(uint8_t* buffer, int len, ddhcp_config* config);
  *
  * In a second step a dhcp_packet is created an send back.
  */
-int dhcp_hdl_discover(int socket, dhcp_packet* discover, ddhcp_config* config);
+int dhcp_hdl_discover(ddhcp_send_queue* queue, dhcp_packet* discover, ddhcp_config* config);
 
 /**
  * DHCP Request
  * Performs on base of de
  */
-int dhcp_hdl_request(int socket, struct dhcp_packet* request, ddhcp_config* config);
+int dhcp_hdl_request(ddhcp_send_queue* queue, struct dhcp_packet* request, ddhcp_config* config);
 
 /**
  * DDHCP Remote Request (Renew)
@@ -35,15 +36,32 @@ int dhcp_rhdl_request(uint32_t* address, ddhcp_config* config);
 /**
  * DDHCP Remote Answer (Ack)
  */
-int dhcp_rhdl_ack(int socket, struct dhcp_packet* request, ddhcp_config* config);
+int dhcp_rhdl_ack(ddhcp_send_queue* queue, struct dhcp_packet* request, ddhcp_config* config);
 
 /**
  * DHCP Release
  */
 void dhcp_hdl_release(dhcp_packet* packet, ddhcp_config* config);
 
-int dhcp_nack(int socket, dhcp_packet* from_client);
-int dhcp_ack(int socket, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config);
+int dhcp_nack(ddhcp_send_queue* queue, dhcp_packet* from_client, ddhcp_config* config);
+int dhcp_ack(ddhcp_send_queue* queue, dhcp_packet* request, ddhcp_block* lease_block, uint32_t lease_index, ddhcp_config* config);
+
+/**
+ * Register the clients of all offered and leased addresses of our blocks
+ * again, after clients could not be indexed for lack of memory. Once all
+ * are registered the unindexed clients are cleared.
+ */
+void dhcp_client_table_rebuild(ddhcp_config* config);
+
+/**
+ * Print usage of the reply template cache into given file descriptor.
+ */
+void dhcp_reply_show_status(int fd, ddhcp_config* config);
+
+/**
+ * Print the counters of the relay agents into given file descriptor.
+ */
+void dhcp_relay_show_status(int fd, ddhcp_config* config);
 
 /**
  * DHCP Lease Available
@@ -62,6 +80,22 @@ int dhcp_num_free(struct ddhcp_block* block);
  */
 int dhcp_num_offered(struct ddhcp_block* block);
 
+/**
+ * Return the absolute end of a lease.
+ */
+time_t dhcp_lease_end(dhcp_lease* lease, ddhcp_config* config);
+
+/**
+ * Set the end of a lease, given as absolute time.
+ */
+void dhcp_lease_set_end(dhcp_lease* lease, time_t lease_end, ddhcp_config* config);
+
+/**
+ * Assert that the lease counters of a block match its bitmaps and states.
+ * Does nothing if NDEBUG is defined.
+ */
+void dhcp_check_counts(ddhcp_block* block);
+
 /**
  * Find first free lease in lease block and return its index.
  * This function asserts that there is a free lease, otherwise
@@ -78,9 +112,10 @@ uint32_t dhcp_get_free_lease(ddhcp_block* block);
 void dhcp_release_lease(uint32_t address, ddhcp_config* config);
 
 /**
- * HouseKeeping: Check for timed out leases.
+ * HouseKeeping: Check for timed out leases and schedule the lease timer
+ * of the block for the next lease to expire.
  * Return the number of free leases in the block.
  */
-int dhcp_check_timeouts(ddhcp_block* block);
+int dhcp_check_timeouts(ddhcp_block* block, ddhcp_config* config);
 
 #endif
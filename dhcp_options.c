@@ -2,20 +2,19 @@
 #include <string.h>
 
 #include "dhcp_options.h"
-#include "list.h"
 #include "logger.h"
 #include "tools.h"
 
-dhcp_option* find_option(dhcp_option* options, uint8_t len, uint8_t code) {
-  dhcp_option* option = options;
+uint8_t* find_option(dhcp_packet* packet, uint8_t code, uint8_t* len) {
+  uint16_t offset = packet->option_offset[code];
 
-  for (; option < options + len; option++) {
-    if (option->code == code) {
-      return option;
-    }
+  if (offset == 0) {
+    *len = 0;
+    return NULL;
   }
 
-  return NULL;
+  *len = packet->option_data[offset - 1];
+  return packet->option_data + offset;
 }
 
 int set_option(dhcp_option* options, uint8_t len, uint8_t code, uint8_t payload_len, uint8_t* payload) {
@@ -40,174 +39,174 @@ int set_option(dhcp_option* options, uint8_t len, uint8_t code, uint8_t payload_
   return 1;
 }
 
-int set_option_from_store(dhcp_option_list* store, dhcp_option* options, uint8_t len, uint8_t code) {
-  dhcp_option* option = find_in_option_store(store, code);
-  if (option == NULL) {
-    DEBUG("set_option_from_store( ... ) -> Option %u not found in store\n", code);
-    return 1;
-  }
-  return set_option(options,len,code,option->len,option->payload);
-}
-
-int find_option_parameter_request_list(dhcp_option* options, uint8_t len, uint8_t** requested) {
-  dhcp_option* option = find_option(options, len, DHCP_CODE_PARAMETER_REQUEST_LIST);
+int find_option_parameter_request_list(dhcp_packet* packet, uint8_t** requested) {
+  uint8_t optlen = 0;
+  uint8_t* payload = find_option(packet, DHCP_CODE_PARAMETER_REQUEST_LIST, &optlen);
 
   if (requested) {
-    *requested = option ? (uint8_t*) option->payload : NULL;
+    *requested = payload;
   }
 
-  int optlen = option ? option->len : 0;
-
   DEBUG("find_option_parameter_request_list(...) -> %i\n", optlen);
 
   return optlen;
 }
 
 
-uint8_t* find_option_requested_address(dhcp_option* options, uint8_t len) {
-  dhcp_option* option = find_option(options, len, DHCP_CODE_REQUESTED_ADDRESS);
+uint8_t* find_option_requested_address(dhcp_packet* packet) {
+  uint8_t len = 0;
+  uint8_t* payload = find_option(packet, DHCP_CODE_REQUESTED_ADDRESS, &len);
+
+  if (len != 4) {
+    payload = NULL;
+  }
 
-  DEBUG("find_option_requested_address(...) -> address %s\n", option ? "found" : "not found");
+  DEBUG("find_option_requested_address(...) -> address %s\n", payload ? "found" : "not found");
+
+  return payload;
+}
 
-  return option ? option->payload : NULL;
+void init_option_store(dhcp_option_store* store) {
+  memset(store, 0, sizeof(dhcp_option_store));
 }
 
-dhcp_option* find_in_option_store(dhcp_option_list* options, uint8_t code) {
+dhcp_option* find_in_option_store(dhcp_option_store* store, uint8_t code) {
   DEBUG("find_in_option_store( store, code: %i)\n", code);
+  return store->options[code];
+}
 
-  dhcp_option* option = NULL;
-  dhcp_option_list* tmp;
+uint32_t find_in_option_store_address_lease_time(dhcp_option_store* store) {
+  return store->lease_time;
+}
 
-  list_for_each_entry(tmp, &options->list, list) {
-    option = tmp->option;
+void _remove_option_in_store(dhcp_option_store* store, uint8_t code) {
+  dhcp_option* option = store->options[code];
 
-    if (option->code == code) {
-      DEBUG("find_in_option_store(...) -> %i\n", code);
-      return option;
-    }
+  if (option == NULL) {
+    return;
   }
 
-  return NULL;
-}
+  store->encoded_len -= option->len + 2;
+  free(store->encoded[code]);
+  free(option);
+  store->options[code] = NULL;
+  store->encoded[code] = NULL;
 
-uint32_t find_in_option_store_address_lease_time(dhcp_option_list* options) {
-  dhcp_option* lease_time_opt = find_in_option_store(options,DHCP_CODE_ADDRESS_LEASE_TIME);
-  if ( lease_time_opt != NULL) {
-    uint32_t buf = 0; 
-    memcpy(&buf,lease_time_opt->payload,4);
-    return ntohl(buf);
-  } 
-  return 0;
+  if (code == DHCP_CODE_ADDRESS_LEASE_TIME) {
+    store->lease_time = 0;
+  }
 }
 
-dhcp_option* set_option_in_store(dhcp_option_list* store, dhcp_option* option) {
+dhcp_option* set_option_in_store(dhcp_option_store* store, dhcp_option* option) {
   DEBUG("set_in_option_store( store, code/len: %i/%i)\n", option->code, option->len);
 
-  dhcp_option* current = find_in_option_store(store, option->code);
-
-  if (current != NULL) {
-    DEBUG("set_in_option_store(...) -> replace option\n");
+  uint8_t* encoded = (uint8_t*) malloc(option->len + 2);
 
-    // Replacing current with new option
-
-    if (current->payload) {
-      free(current->payload);
-    }
+  if (encoded == NULL) {
+    WARNING("set_in_option_store(...) -> unable to allocate memory\n");
+    return NULL;
+  }
 
-    current->len = option->len;
-    current->payload = option->payload;
+  encoded[0] = option->code;
+  encoded[1] = option->len;
+  memcpy(encoded + 2, option->payload, option->len);
 
-    return current;
-  } else {
-    DEBUG("set_in_option_store(...) -> append option\n");
+  free(option->payload);
+  option->payload = encoded + 2;
 
-    dhcp_option_list* tmp;
-    tmp = (dhcp_option_list*) malloc(sizeof(dhcp_option_list));
-    tmp->option = option;
+  _remove_option_in_store(store, option->code);
 
-    list_add_tail((&tmp->list), &(store->list));
+  store->options[option->code] = option;
+  store->encoded[option->code] = encoded;
+  store->encoded_len += option->len + 2;
 
-    return option;
+  if (option->code == DHCP_CODE_ADDRESS_LEASE_TIME && option->len == 4) {
+    uint32_t buf = 0;
+    memcpy(&buf, option->payload, 4);
+    store->lease_time = ntohl(buf);
   }
-}
 
-void remove_option_in_store(dhcp_option_list* store, uint8_t code) {
-  struct list_head* pos, *q;
-  dhcp_option_list* tmp;
+  store->generation++;
 
-  list_for_each_safe(pos, q, &store->list) {
-    tmp = list_entry(pos, dhcp_option_list, list);
-    dhcp_option* option = tmp->option;
-    if ( option->code == code ) {
-      list_del(pos);
+  return option;
+}
 
-      if (option->payload) {
-        free(option->payload);
-      }
+void remove_option_in_store(dhcp_option_store* store, uint8_t code) {
+  _remove_option_in_store(store, code);
+  store->generation++;
+}
 
-      free(option);
-      free(tmp);
-    }
+void free_option_store(dhcp_option_store* store) {
+  for (int code = 0; code < 256; code++) {
+    _remove_option_in_store(store, code);
   }
 }
 
-void free_option_store(dhcp_option_list* store) {
-  struct list_head* pos, *q;
-  dhcp_option_list* tmp;
+uint16_t _encode_option(dhcp_option_store* store, uint8_t code, uint8_t* buffer, uint16_t len, uint16_t size) {
+  dhcp_option* option = store->options[code];
 
-  list_for_each_safe(pos, q, &store->list) {
-    tmp = list_entry(pos, dhcp_option_list, list);
-    dhcp_option* option = tmp->option;
-    list_del(pos);
-
-    if (option->payload) {
-      free(option->payload);
-    }
-
-    free(option);
-    free(tmp);
+  if (option == NULL || len + option->len + 2 > size) {
+    return len;
   }
+
+  memcpy(buffer + len, store->encoded[code], option->len + 2);
+  return len + option->len + 2;
 }
 
-dhcp_option* remove_option_from_store(dhcp_option_list* store, uint8_t code);
+uint16_t encode_reply_options(uint8_t msg_type, dhcp_packet* request, dhcp_option_store* store, uint8_t* buffer, uint16_t size) {
+  uint16_t len = 0;
 
-int fill_options(dhcp_option* options, uint8_t len, dhcp_option_list* option_store, uint8_t additional, dhcp_option** fullfil) {
-  int num_found_options = 0;
+  if (size < 3) {
+    return 0;
+  }
 
-  uint8_t* requested = NULL;
-  int8_t max_options = find_option_parameter_request_list(options, len, &requested);
+  // DHCP Message Type
+  buffer[len++] = DHCP_CODE_MESSAGE_TYPE;
+  buffer[len++] = 1;
+  buffer[len++] = msg_type;
 
-  *fullfil = (dhcp_option*) calloc(sizeof(dhcp_option), max_options + additional);
+  // DHCP Lease Time and Server identifier
+  len = _encode_option(store, DHCP_CODE_ADDRESS_LEASE_TIME, buffer, len, size);
+  len = _encode_option(store, DHCP_CODE_SERVER_IDENTIFIER, buffer, len, size);
 
-  if (! max_options) {
-    return additional;
-  }
+  uint64_t done[4] = { 0 };
+  done[DHCP_CODE_PAD / 64] |= 1ULL << (DHCP_CODE_PAD % 64);
+  done[DHCP_CODE_END / 64] |= 1ULL << (DHCP_CODE_END % 64);
+  done[DHCP_CODE_MESSAGE_TYPE / 64] |= 1ULL << (DHCP_CODE_MESSAGE_TYPE % 64);
+  done[DHCP_CODE_ADDRESS_LEASE_TIME / 64] |= 1ULL << (DHCP_CODE_ADDRESS_LEASE_TIME % 64);
+  done[DHCP_CODE_SERVER_IDENTIFIER / 64] |= 1ULL << (DHCP_CODE_SERVER_IDENTIFIER % 64);
 
-  for (uint8_t i = 0; i < max_options; i++) {
+  uint8_t* requested = NULL;
+  int max_options = find_option_parameter_request_list(request, &requested);
+
+  for (int i = 0; i < max_options; i++) {
     uint8_t code = requested[i];
-    // LOOP thought option_store
-    dhcp_option* option = find_in_option_store(option_store, code);
 
-    if (option != NULL) {
-      memcpy(*fullfil + num_found_options, option, sizeof(dhcp_option));
-      num_found_options++;
+    if (done[code / 64] & (1ULL << (code % 64))) {
+      continue;
     }
+
+    done[code / 64] |= 1ULL << (code % 64);
+    len = _encode_option(store, code, buffer, len, size);
   }
 
-  return num_found_options + additional;
+  return len;
 }
 
 void dhcp_options_show(int fd, ddhcp_config* config) {
-  struct list_head* pos, *q;
-  dhcp_option_list* tmp;
-  dhcp_option_list* store = &config->options;
+  dhcp_option_store* store = &config->options;
 
   dprintf(fd,"DHCP Lease Time: %u\n\n",find_in_option_store_address_lease_time(&config->options));
   dprintf(fd,"DHCP Disabled: %u\n",config->disable_dhcp);
   dprintf(fd,"DHCP Option Store\ncode\tlen\tpayload\n");
-  list_for_each_safe(pos, q, &store->list) {
-    tmp = list_entry(pos, dhcp_option_list, list);
-    dhcp_option* option = tmp->option;
+
+  for (int code = 0; code < 256; code++) {
+    dhcp_option* option = store->options[code];
+
+    if (option == NULL) {
+      continue;
+    }
+
     dprintf(fd, "%i\t%i\t", option->code, option->len);
 
     for (int i = 0; i < option->len; i++) {
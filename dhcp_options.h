@@ -4,10 +4,10 @@
 #include "types.h"
 
 /**
- * Search and returns an dhcp_option in a list of options.
- * Returns NULL otherwise.
+ * Returns the payload of an option of a received packet and sets len to its
+ * length. Returns NULL otherwise.
  */
-dhcp_option* find_option(dhcp_option* options, uint8_t len, uint8_t code);
+uint8_t* find_option(dhcp_packet* packet, uint8_t code, uint8_t* len);
 
 /**
  * Search for the option with searched code and replace payload or search an empty
@@ -23,61 +23,66 @@ int set_option(dhcp_option* options, uint8_t len, uint8_t code, uint8_t payload_
 void remove_option(dhcp_option* options, uint8_t code);
 
 /**
- * Search for the parameter request list option in a list of options.
+ * Search for the parameter request list option of a received packet.
  * On success the requested pointer is set and a positiv integer
  * is returned. Otherwise 0 is returned and requested is pointed to NULL.
  */
-int find_option_parameter_request_list(dhcp_option* options, uint8_t len, uint8_t** requested);
+int find_option_parameter_request_list(dhcp_packet* packet, uint8_t** requested);
 
-/** Search for the requested ip address option in a list of options.
- * On success the pointer to the payload is returned, which should be
- * of length 4. TODO Check this
+/** Search for the requested ip address option of a received packet.
+ * On success the pointer to the payload of length 4 is returned.
  * Otherwise the null-pointer is returned.
  */
-uint8_t* find_option_requested_address(dhcp_option* options, uint8_t len);
+uint8_t* find_option_requested_address(dhcp_packet* packet);
 
 /**
- * First searches the parameter request list in the given options list.
- * Then use the option_store to fulfill those request. The result is
- * left in the fullfil list. In front of the list additional many options are reserved.
- * On failure fullfil_list is the null-pointer and 0 is returned.
- *
- * Caller must handle memory deallocation.
+ * Encode the options of a reply of type msg_type to request into buffer:
+ * The message type, lease time and server identifier followed by the
+ * options of the parameter request list found in the store, each copied in
+ * its wire encoding. Options not fitting into size bytes are left out.
+ * Returns the number of bytes written.
  */
-int fill_options(dhcp_option* options, uint8_t len, dhcp_option_list* option_store, uint8_t additional, dhcp_option** fullfil);
+uint16_t encode_reply_options(uint8_t msg_type, dhcp_packet* request, dhcp_option_store* store, uint8_t* buffer, uint16_t size);
+
+/**
+ * Initialize an empty option store.
+ */
+void init_option_store(dhcp_option_store* store);
 
 /**
  * Search and Retrun a option in an option store. Return null otherwise.
  */
-dhcp_option* find_in_option_store(dhcp_option_list* options, uint8_t code);
+dhcp_option* find_in_option_store(dhcp_option_store* store, uint8_t code);
 
 /**
  * Search and return leasetime option
  */
-uint32_t find_in_option_store_address_lease_time(dhcp_option_list* options);
+uint32_t find_in_option_store_address_lease_time(dhcp_option_store* store);
 
 /**
- * Is a option defined in a dhcp_option_list
+ * Is a option defined in a dhcp_option_store
  */
 #define has_in_option_store(options, code) (find_in_option_store(options, code) != NULL)
 
 /**
- * Search and replace a option in the store, otherwise append it to the store.
+ * Search and replace a option in the store, otherwise add it to the store.
+ * The store takes ownership of option, its payload is replaced by a pointer
+ * into the encoded option.
  */
-dhcp_option* set_option_in_store(dhcp_option_list* store, dhcp_option* option);
+dhcp_option* set_option_in_store(dhcp_option_store* store, dhcp_option* option);
 
 /**
  * Search and remove a option in the store.
  */
-void remove_option_in_store(dhcp_option_list* store, uint8_t code);
+void remove_option_in_store(dhcp_option_store* store, uint8_t code);
 
 /**
  * Free option store and all contained dhcp_options.
  */
-void free_option_store(dhcp_option_list* store);
+void free_option_store(dhcp_option_store* store);
 
 /**
- * Print the inventory of a dhcp_option_list into given file descriptor.
+ * Print the inventory of a dhcp_option_store into given file descriptor.
  */
 void dhcp_options_show(int fd, ddhcp_config* config);
 
@@ -86,8 +91,4 @@ void dhcp_options_show(int fd, ddhcp_config* config);
  */
 void dhcp_options_init(ddhcp_config* config);
 
-/** 
- * Search for option in store and if found store it in the options list.
- */
-int set_option_from_store(dhcp_option_list* store, dhcp_option* options, uint8_t len, uint8_t code);
 #endif
@@ -4,12 +4,10 @@
 #include <stdio.h>
 
 #include "types.h"
+#include "batch.h"
+#include "clock.h"
 #include "logger.h"
 
-struct sockaddr_in broadcast = {
-  .sin_family = AF_INET,
-  .sin_addr = {INADDR_BROADCAST},
-};
 
 
 #if LOG_LEVEL >= LOG_DEBUG
@@ -47,24 +45,29 @@ void printf_dhcp(dhcp_packet* packet) {
   free(giaddr_str);
   free(siaddr_str);
 
-  dhcp_option* option = packet->options;
+  for (int code = 1; code < DHCP_CODE_END; code++) {
+    uint16_t offset = packet->option_offset[code];
 
-  for (int i = 0; i < packet->options_len; i++) {
-    if (option->len == 1) {
-      DEBUG("DHCP OPTION [ code %i, length %i, value %i ]\n", option->code, option->len, option->payload[0]);
-    } else if (option->code == DHCP_CODE_PARAMETER_REQUEST_LIST) {
-      DEBUG("DHCP OPTION [ code %i, length %i, value ", option->code, option->len);
+    if (offset == 0) {
+      continue;
+    }
+
+    uint8_t* payload = packet->option_data + offset;
+    uint8_t len = payload[-1];
 
-      for (int k = 0; k < option->len; k++) {
-        LOG("%i ", option->payload[k]);
+    if (len == 1) {
+      DEBUG("DHCP OPTION [ code %i, length %i, value %i ]\n", code, len, payload[0]);
+    } else if (code == DHCP_CODE_PARAMETER_REQUEST_LIST) {
+      DEBUG("DHCP OPTION [ code %i, length %i, value ", code, len);
+
+      for (int k = 0; k < len; k++) {
+        LOG("%i ", payload[k]);
       }
 
       LOG("]\n");
     } else {
-      DEBUG("DHCP OPTION [ code %i, length %i ]\n", option->code, option->len);
+      DEBUG("DHCP OPTION [ code %i, length %i ]\n", code, len);
     }
-
-    option++;
   }
 }
 # else
@@ -91,7 +94,7 @@ int _dhcp_packet_len(dhcp_packet* packet) {
     option++;
   }
 
-  return len;
+  return len + packet->option_data_len;
 }
 
 int ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, int len) {
@@ -103,8 +106,6 @@ int ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, int len) {
     return -1;
   }
 
-  printf("LEN:%i\n", len);
-
   // TODO Use macros to read from the buffer
 
   packet->op    = buffer[0];
@@ -121,6 +122,7 @@ int ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, int len) {
   memcpy(&packet->yiaddr, buffer + 16, 4);
   memcpy(&packet->siaddr, buffer + 20, 4);
   memcpy(&packet->giaddr, buffer + 24, 4);
+  packet->relay = NULL;
   memcpy(&packet->chaddr, buffer + 28, 16);
   memcpy(&packet->sname, buffer + 44, 64);
   memcpy(&packet->file, buffer + 108, 128);
@@ -135,99 +137,58 @@ int ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, int len) {
     return -7;
   }
 
-  uint8_t* option = buffer + 236 + 4;
+  packet->options_len = 0;
+  packet->options = NULL;
+  memset(packet->option_offset, 0, sizeof(packet->option_offset));
 
-  // Count options
-  int options = 0;
-  int exit = 0;
-  int dhcp_message_type = 0;
-  int dhcp_request_list = 0;
+  // Index the options, the first occurrence of a code wins.
+  uint8_t* options = buffer + 240;
+  int options_len = len - 240;
+  int pos = 0;
 
-  while (option < buffer + len && exit == 0) {
-    switch ((uint8_t) option[0]) {
-    case DHCP_CODE_PAD:
-      // JUMP the padding
-      option += 1;
-      continue;
-      break;
+  while (pos < options_len) {
+    uint8_t code = options[pos];
 
-    case DHCP_CODE_END:
-      options++;
-      exit = 1;
+    if (code == DHCP_CODE_PAD) {
+      pos++;
       continue;
-      break;
-
-    case DHCP_CODE_MESSAGE_TYPE:
-      dhcp_message_type = 1;
-      break;
+    }
 
-    case DHCP_CODE_PARAMETER_REQUEST_LIST:
-      dhcp_request_list = 1;
-      break;
-
-    default:
+    if (code == DHCP_CODE_END) {
       break;
     }
 
-    if (option + 1 > buffer + len) {
+    if (pos + 1 >= options_len) {
       WARNING("DHCP options ended improperly, possible broken client.\n");
       return -4;
     }
 
-    if (option + option[1] + 2 > buffer + len) {
+    if (pos + 2 + options[pos + 1] > options_len) {
       // Error: Malformed dhcp options
       WARNING("DHCP options smaller than len of last option suggest, possible broken client.\n");
       return -5;
-    } else {
-      option += (uint8_t) option[1] + 2;
-      options++;
     }
-  }
 
-  if (dhcp_message_type != 1) {
-    INFO("Message contains no message type - invalid!\n");
-    return -6;
-  }
+    if (packet->option_offset[code] == 0) {
+      packet->option_offset[code] = pos + 2;
+    }
 
-  if (dhcp_request_list != 1) {
-    DEBUG("Message contains no dhcp request list - broken client?\n");
+    pos += 2 + options[pos + 1];
   }
 
-  packet->options_len = options;
-  packet->options = (dhcp_option*) malloc(sizeof(dhcp_option) * options);
+  packet->option_data = options;
+  packet->option_data_len = pos;
 
-  option = buffer + 236 + 4;
+  uint16_t message_type = packet->option_offset[DHCP_CODE_MESSAGE_TYPE];
 
-  exit = 0;
-  int i = 0;
-
-  while (option < buffer + len && exit == 0) {
-    switch ((uint8_t) option[0]) {
-    case DHCP_CODE_END:
-      exit = 1;
-
-    case DHCP_CODE_PAD:
-      // JUMP padding and end
-      packet->options[i].code = option[0];
-      packet->options[i].len  = 0;
-      packet->options[i].payload = NULL;
-
-      option += 1;
-      i++;
-      break;
-
-    default:
-      packet->options[i].code = option[0];
-      packet->options[i].len  = option[1];
-      packet->options[i].payload = option + 2;
-
-      option += (uint8_t) option[1] + 2;
-      i++;
-      break;
-    }
+  if (message_type == 0 || options[message_type - 1] != 1) {
+    INFO("Message contains no message type - invalid!\n");
+    return -6;
   }
 
-  assert(i == options);
+  if (packet->option_offset[DHCP_CODE_PARAMETER_REQUEST_LIST] == 0) {
+    DEBUG("Message contains no dhcp request list - broken client?\n");
+  }
 
 #if LOG_LEVEL >= LOG_INFO
   printf_dhcp(packet);
@@ -236,12 +197,10 @@ int ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, int len) {
   return 0;
 }
 
-int dhcp_packet_send(int socket, dhcp_packet* packet) {
-  DEBUG("dhcp_packet_send(%i, dhcp_packet)\n", socket);
+int hton_dhcp_packet(dhcp_packet* packet, uint8_t* buffer) {
   uint16_t tmp16;
   uint32_t tmp32;
-
-  uint8_t* buffer = calloc(sizeof(char), _dhcp_packet_len(packet));
+  int len = _dhcp_packet_len(packet);
 
   // Header
   buffer[0] = packet->op;
@@ -291,50 +250,86 @@ int dhcp_packet_send(int socket, dhcp_packet* packet) {
     option++;
   }
 
-  buffer[_dhcp_packet_len(packet) - 1] = 255;
-  assert(obuf + 1 == buffer + _dhcp_packet_len(packet));
-  // Network send
-  printf("Message LEN: %i\n", _dhcp_packet_len(packet));
+  if (packet->option_data_len > 0) {
+    memcpy(obuf, packet->option_data, packet->option_data_len);
+    obuf += packet->option_data_len;
+  }
+
+  obuf[0] = DHCP_CODE_END;
+  assert(obuf + 1 == buffer + len);
+
+  return len;
+}
+
+int dhcp_packet_send_buffer(ddhcp_send_queue* queue, uint8_t* buffer, int len, struct sockaddr_in* dest) {
+  DEBUG("dhcp_packet_send_buffer(%i, buffer, %i, %s:%i)\n", queue->socket, len, inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
+
+  uint8_t* datagram = batch_queue_push(queue, len, (struct sockaddr*) dest, sizeof(struct sockaddr_in));
+
+  if (datagram == NULL) {
+    return 1;
+  }
+
+  memcpy(datagram, buffer, len);
+
+  return 0;
+}
 
-  broadcast.sin_port = htons(68);
+int dhcp_packet_send(ddhcp_send_queue* queue, dhcp_packet* packet, struct sockaddr_in* dest) {
+  DEBUG("dhcp_packet_send(%i, dhcp_packet, %s:%i)\n", queue->socket, inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
 
-  int ret = sendto(socket, buffer, _dhcp_packet_len(packet), 0, (struct sockaddr*)&broadcast, sizeof(broadcast));
+  uint8_t* datagram = batch_queue_push(queue, _dhcp_packet_len(packet), (struct sockaddr*) dest, sizeof(struct sockaddr_in));
 
-  if (ret < 0) {
-    perror("sendto");
-    printf("Err: %i\n", errno);
+  if (datagram == NULL) {
+    return 1;
   }
 
-  free(buffer);
+  hton_dhcp_packet(packet, datagram);
 
   return 0;
 }
 
 int dhcp_packet_copy(dhcp_packet* dest, dhcp_packet* src) {
   memcpy(dest, src, sizeof(struct dhcp_packet));
-  dest->options = (struct dhcp_option*) calloc(src->options_len, sizeof(struct dhcp_option));
+  dest->options = NULL;
+  dest->option_data = NULL;
 
-  if (dest->options == NULL) {
-    return 1;
+  if (src->options_len > 0) {
+    dest->options = (struct dhcp_option*) calloc(src->options_len, sizeof(struct dhcp_option));
+
+    if (dest->options == NULL) {
+      return 1;
+    }
+
+    dhcp_option* src_option = src->options;
+    dhcp_option* dest_option = dest->options;
+
+    for (; src_option < src->options + src->options_len; src_option++) {
+      uint8_t* dest_payload = (uint8_t*) calloc(src_option->len, sizeof(uint8_t));
+      memcpy(dest_payload, src_option->payload, src_option->len);
+      dest_option->code = src_option->code;
+      dest_option->len = src_option->len;
+      dest_option->payload = dest_payload;
+      dest_option++;
+    }
   }
 
-  dhcp_option* src_option = src->options;
-  dhcp_option* dest_option = dest->options;
+  // The offsets stay valid for a copy of the raw options.
+  if (src->option_data_len > 0) {
+    dest->option_data = (uint8_t*) malloc(src->option_data_len);
 
-  for (; src_option < src->options + src->options_len; src_option++) {
-    uint8_t* dest_payload = (uint8_t*) calloc(src_option->len, sizeof(uint8_t));
-    memcpy(dest_payload, src_option->payload, src_option->len);
-    dest_option->code = src_option->code;
-    dest_option->len = src_option->len;
-    dest_option->payload = dest_payload;
-    dest_option++;
+    if (dest->option_data == NULL) {
+      return 1;
+    }
+
+    memcpy(dest->option_data, src->option_data, src->option_data_len);
   }
 
   return 0;
 }
 
 int dhcp_packet_list_add(dhcp_packet_list* list, dhcp_packet* packet) {
-  time_t now = time(NULL);
+  time_t now = clock_now();
   // Save dhcp packet, for further actions, later.
   dhcp_packet_list* tmp = calloc(1, sizeof(dhcp_packet_list));
 
@@ -398,24 +393,20 @@ void dhcp_packet_list_free(dhcp_packet_list* list) {
 }
 
 uint8_t dhcp_packet_message_type(dhcp_packet* packet) {
-  dhcp_option* option = packet->options;
+  uint16_t offset = packet->option_offset[DHCP_CODE_MESSAGE_TYPE];
 
-  for (int i = 0; i < packet->options_len; i++) {
-    if (option->code == DHCP_CODE_MESSAGE_TYPE) {
-      return (uint8_t) option->payload[0];
-    }
-
-    option++;
+  if (offset == 0) {
+    return 0;
   }
 
-  return 0;
+  return packet->option_data[offset];
 }
 
 void dhcp_packet_list_timeout(dhcp_packet_list* list) {
   DEBUG("dhcp_packet_list_timeout(list)\n");
   struct list_head* pos, *q;
   dhcp_packet_list* tmp;
-  time_t now = time(NULL);
+  time_t now = clock_now();
 
   list_for_each_safe(pos, q, &list->list) {
     tmp = list_entry(pos, dhcp_packet_list, list);
@@ -424,8 +415,19 @@ void dhcp_packet_list_timeout(dhcp_packet_list* list) {
       dhcp_packet* packet = tmp->packet;
       list_del(pos);
       dhcp_packet_free(packet, 1);
+      free(packet);
       free(tmp);
       DEBUG("dhcp_packet_list_timeout( ... ): drop packet from cache\n");
     }
   }
 }
+
+time_t dhcp_packet_list_next_timeout(dhcp_packet_list* list) {
+  if (list_empty(&list->list)) {
+    return 0;
+  }
+
+  // Packets are added in order of their timeout.
+  dhcp_packet_list* first = list_first_entry(&list->list, dhcp_packet_list, list);
+  return first->packet->timeout + 1;
+}
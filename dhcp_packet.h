@@ -4,8 +4,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
+
+// Room for the options of a reply sent in a single ethernet frame.
+#define DHCP_OPTIONS_MAX_LEN (1500 - 20 - 8 - 240 - 1)
+#define DHCP_PACKET_MAX_LEN (240 + DHCP_OPTIONS_MAX_LEN + 1)
+
 #include "types.h"
 
+struct ddhcp_send_queue;
+
 struct dhcp_packet {
   uint8_t op;
   uint8_t htype;
@@ -23,7 +30,15 @@ struct dhcp_packet {
   struct in_addr yiaddr;
   struct in_addr siaddr;
   struct in_addr giaddr;
+  // The relay agent a request was accepted from, NULL if untracked.
+  struct dhcp_relay* relay;
+  // Options of packets we build, sent in front of option_data.
   struct dhcp_option* options;
+  // The raw option area. For received packets option_offset holds per code
+  // the offset of the payload in it, zero if the option is absent.
+  uint8_t* option_data;
+  uint16_t option_data_len;
+  uint16_t option_offset[256];
 };
 typedef struct dhcp_packet dhcp_packet;
 
@@ -33,6 +48,9 @@ struct dhcp_packet_list {
 };
 typedef struct dhcp_packet_list dhcp_packet_list;
 
+// Set by clients which can not receive unicast before their address is configured.
+#define DHCP_FLAG_BROADCAST 0x8000
+
 enum dhcp_message_type {
   DHCPDISCOVER  = 1,
   DHCPOFFER     = 2,
@@ -48,10 +66,6 @@ enum dhcp_message_type {
  * Store a packet in the packet_list, create a copy of the packet.
  */
 int dhcp_packet_list_add(dhcp_packet_list* list, dhcp_packet* packet);
-  int8_t chaddr[16];
-  char sname[64];
-  char file[128];
-  uint8_t options_len;
 
 /**
  * Search for a packet in the dhcp_packet_list checking chaddr and xid.
@@ -63,6 +77,12 @@ dhcp_packet* dhcp_packet_list_find(dhcp_packet_list* list, uint32_t xid, uint8_t
  */
 void dhcp_packet_list_timeout(dhcp_packet_list* list);
 
+/**
+ * Return the point in time the next packet is dropped from the packet
+ * list, or 0 if the list is empty.
+ */
+time_t dhcp_packet_list_next_timeout(dhcp_packet_list* list);
+
 /**
  * Free DHCP packet list
  */
@@ -80,7 +100,8 @@ int dhcp_packet_copy(dhcp_packet* dest, dhcp_packet* src);
 
 
 /**
- * Free a packet.
+ * Free a packet, with free_payload set the raw options of a copied packet
+ * are freed as well.
  */
 #define dhcp_packet_free(packet,free_payload) do {\
     if ( free_payload > 0 ) {\
@@ -88,6 +109,7 @@ int dhcp_packet_copy(dhcp_packet* dest, dhcp_packet* src);
       for (; _option < packet->options + packet->options_len; _option++) {\
         free(_option->payload);\
       }\
+      free(packet->option_data);\
     }\
     free(packet->options);\
   } while(0)
@@ -97,9 +119,28 @@ int dhcp_packet_copy(dhcp_packet* dest, dhcp_packet* src);
  * To reduce memory consumption and prevent further memcpy operations this will
  * make pointer to the buffer inside of the dhcp_packet structure. Do not free
  * the buffer before the last operation on that struture!
+ * The options are indexed by code in a single pass, without allocation.
  */
 int ntoh_dhcp_packet(dhcp_packet* packet, uint8_t* buffer, int len);
-int dhcp_packet_send(int socket, dhcp_packet* packet);
 
+/**
+ * Writes packet into buffer, which must be large enough to hold it.
+ * Returns the length of the packet.
+ */
+int hton_dhcp_packet(dhcp_packet* packet, uint8_t* buffer);
+
+/**
+ * Queue a packet for a client or relay agent at dest.
+ */
+int dhcp_packet_send(struct ddhcp_send_queue* queue, dhcp_packet* packet, struct sockaddr_in* dest);
+
+/**
+ * Queue an already serialized packet for a client or relay agent at dest.
+ */
+int dhcp_packet_send_buffer(struct ddhcp_send_queue* queue, uint8_t* buffer, int len, struct sockaddr_in* dest);
+
+/**
+ * Message type of a received packet.
+ */
 uint8_t dhcp_packet_message_type(dhcp_packet* packet);
 #endif
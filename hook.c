@@ -2,13 +2,16 @@
 #include "logger.h"
 #include "tools.h"
 
+#include <stdlib.h>
 #include <unistd.h>
 
 void hook(uint8_t type, struct in_addr* address, uint8_t* chaddr, ddhcp_config* config) {
-  DEBUG("hook(%i,%s,%s,config)\n",type, inet_ntoa(*address), hwaddr2c(chaddr));
+  char* hwaddr = hwaddr2c(chaddr);
+  DEBUG("hook(%i,%s,%s,config)\n",type, inet_ntoa(*address), hwaddr);
 
   if (config->hook_command) {
     DEBUG("hook( ... ): No hook command set");
+    free(hwaddr);
     return;
   }
 
@@ -16,14 +19,16 @@ void hook(uint8_t type, struct in_addr* address, uint8_t* chaddr, ddhcp_config*
 
   switch (type) {
   case HOOK_LEASE:
-    execl(config->hook_command, "lease", inet_ntoa(*address), hwaddr2c(chaddr), (char*) 0);
+    execl(config->hook_command, "lease", inet_ntoa(*address), hwaddr, (char*) 0);
     break;
 
   case HOOK_RELEASE:
-    execl(config->hook_command, "release", inet_ntoa(*address), hwaddr2c(chaddr), (char*) 0);
+    execl(config->hook_command, "release", inet_ntoa(*address), hwaddr, (char*) 0);
     break;
   }
 
+  free(hwaddr);
+
   if (err < 0) {
     FATAL("hook( ... ): Command can not be executed.\n");
   }
@@ -4,6 +4,7 @@
 #include <math.h>
 #include <netinet/in.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -12,13 +13,16 @@
 #include <unistd.h>
 #include <netdb.h>
 
+#include "batch.h"
 #include "block.h"
+#include "clock.h"
 #include "ddhcp.h"
 #include "dhcp.h"
 #include "dhcp_packet.h"
 #include "logger.h"
 #include "netsock.h"
 #include "packet.h"
+#include "timer.h"
 #include "tools.h"
 #include "dhcp_options.h"
 #include "control.h"
@@ -38,6 +42,12 @@ void* get_in_addr(struct sockaddr* sa)
   return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+int get_blocks_needed(ddhcp_config* config) {
+  int spares = block_num_free_leases(config);
+  int spare_blocks = ceil((double) spares / (double) config->block_size);
+  return config->spare_blocks_needed - spare_blocks;
+}
+
 /**
  * House Keeping
  *
@@ -45,22 +55,68 @@ void* get_in_addr(struct sockaddr* sa)
  * - Refresh timed-out blocks.
  * + Claim new blocks if we are low on spare leases.
  * + Update our claims.
+ * + Index clients again, which could not be indexed for lack of memory.
  */
 void house_keeping(ddhcp_config* config) {
   DEBUG("house_keeping( blocks, config )\n");
+  time_t now = clock_now();
+  config->house_keeping_runs++;
   block_check_timeouts(config);
 
-  int spares = block_num_free_leases(config);
-  int spare_blocks = ceil((double) spares / (double) config->block_size);
-  int blocks_needed = config->spare_blocks_needed - spare_blocks;
+  int blocks_needed = get_blocks_needed(config);
+
+  // Claim rounds go on while blocks are claimed or still missing.
+  if (config->next_claim_round != 0 ? now >= config->next_claim_round : blocks_needed > 0) {
+    block_claim(blocks_needed, config);
+
+    if (config->num_blocks[DDHCP_CLAIMING] > 0 || get_blocks_needed(config) > 0) {
+      config->next_claim_round = block_claim_next_round(config);
+    } else {
+      config->next_claim_round = 0;
+    }
+  }
 
-  block_claim(blocks_needed, config);
   block_update_claims(blocks_needed, config);
 
   dhcp_packet_list_timeout(&config->dhcp_packet_cache);
+
+  if (config->clients.unindexed > 0) {
+    dhcp_client_table_rebuild(config);
+  }
+
+  block_table_reclaim(config);
   DEBUG("house_keeping( ... ) finish\n\n");
 }
 
+#define SCHEDULE(next, deadline) do {\
+    time_t _deadline = (deadline);\
+    if (_deadline != 0 && (next == 0 || _deadline < next)) {\
+      next = _deadline;\
+    }\
+  } while (0)
+
+/**
+ * Compute when house keeping is due next: At the earliest expiry of a
+ * block or lease timer, claim round, claim update or cached packet.
+ * Returns 0 if nothing is due at all.
+ */
+time_t schedule_house_keeping(ddhcp_config* config) {
+  time_t next = 0;
+
+  if (config->next_claim_round != 0) {
+    SCHEDULE(next, config->next_claim_round);
+  } else if (get_blocks_needed(config) > 0) {
+    SCHEDULE(next, clock_now());
+  }
+
+  SCHEDULE(next, timer_wheel_next(&config->timers));
+  SCHEDULE(next, block_next_update(config));
+  SCHEDULE(next, dhcp_packet_list_next_timeout(&config->dhcp_packet_cache));
+
+  config->next_wakeup = next;
+  return next;
+}
+
 void add_fd(int efd, int fd, uint32_t events) {
   struct epoll_event event = { 0 };
   event.data.fd = fd;
@@ -89,11 +145,45 @@ void del_fd(int efd, int fd, uint32_t events) {
   }
 }
 
-uint32_t get_loop_timeout(ddhcp_config* config) {
-  //Multiply by 500 to convert the timeout value given in seconds
-  //into milliseconds AND dividing the value by two at the same time.
-  //The integer overflow occuring for timeouts greater than 99.4 days is ignored here.
-  return floor(config->tentative_timeout * 500);
+void mod_fd(int efd, int fd, uint32_t events) {
+  struct epoll_event event = { 0 };
+  event.data.fd = fd;
+  event.events = events;
+
+  if (epoll_ctl(efd, EPOLL_CTL_MOD, fd, &event) == -1) {
+    perror("epoll_ctl");
+  }
+}
+
+/**
+ * Send the datagrams queued by the last iteration of the event loop.
+ * While a socket buffer is full we additionally wait for the socket
+ * to become writable.
+ */
+void flush_queue(int efd, ddhcp_send_queue* queue) {
+  uint8_t blocked = queue->blocked;
+
+  batch_queue_flush(queue);
+
+  if (queue->blocked != blocked) {
+    mod_fd(efd, queue->socket, EPOLLIN | EPOLLET | (queue->blocked ? EPOLLOUT : 0));
+  }
+}
+
+uint32_t get_claim_interval(ddhcp_config* config) {
+  // Claim rounds run twice per tentative timeout, at least one second apart.
+  uint32_t interval = (config->tentative_timeout + 1) / 2;
+  return interval > 0 ? interval : 1;
+}
+
+void arm_timer(int tfd, time_t wakeup) {
+  struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+  // A zero value disarms the timer.
+  spec.it_value.tv_sec = wakeup;
+
+  if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    perror("timerfd_settime");
+  }
 }
 
 typedef void (*sighandler_t)(int);
@@ -127,7 +217,6 @@ int main(int argc, char** argv) {
 
   ddhcp_config* config = (ddhcp_config*) calloc(sizeof(ddhcp_config), 1);
   config->block_size = 32;
-  config->claiming_blocks_amount = 0;
 
   inet_aton("10.0.0.0", &config->prefix);
   config->prefix_len = 24;
@@ -142,9 +231,7 @@ int main(int argc, char** argv) {
 
   // DHCP
   config->dhcp_port = 67;
-  INIT_LIST_HEAD(&(config->options).list);
-
-  INIT_LIST_HEAD(&(config->claiming_blocks).list);
+  init_option_store(&config->options);
 
   INIT_LIST_HEAD(&(config->dhcp_packet_cache).list);
 
@@ -310,6 +397,8 @@ int main(int argc, char** argv) {
     //openlog("ddhcp", LOG_PID | LOG_CONS | LOG_NDELAY, LOG_DAEMON);
   }
 
+  clock_update();
+
   // init block stucture
   ddhcp_block_init(config);
   dhcp_options_init(config);
@@ -319,12 +408,34 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  // Nodes powered up together must not pick the same random blocks.
+  uint32_t seed = time(NULL);
+
+  for (uint32_t i = 0; i < sizeof(ddhcp_node_id); i++) {
+    seed = seed * 31 + config->node_id[i];
+  }
+
+  srand(seed);
+
   if (control_open(config) == -1) {
     return 1;
   }
 
   uint8_t* buffer = (uint8_t*) malloc(sizeof(uint8_t) * 1500);
   int bytes = 0;
+  ddhcp_recv_batch* batch = &config->recv_batch;
+
+  if (buffer == NULL || batch_init(batch) > 0) {
+    FATAL("Unable to allocate receive buffers\n");
+    return 1;
+  }
+
+  if (batch_queue_init(&config->mcast_queue, config->mcast_socket) > 0
+      || batch_queue_init(&config->server_queue, config->server_socket) > 0
+      || batch_queue_init(&config->client_queue, config->client_socket) > 0) {
+    FATAL("Unable to allocate send buffers\n");
+    return 1;
+  }
 
   int efd;
   int maxevents = 64;
@@ -348,74 +459,93 @@ int main(int argc, char** argv) {
   events = calloc(maxevents, sizeof(struct epoll_event));
 
   uint8_t need_house_keeping;
-  uint32_t loop_timeout = config->loop_timeout = get_loop_timeout(config);
+  config->claim_interval = get_claim_interval(config);
+
+  // Listen to the claims of other nodes before claiming blocks ourself.
+  if (!early_housekeeping) {
+    config->next_claim_round = clock_now() + config->claim_interval;
+  }
+
+  INFO("claim interval: %u secs\n", config->claim_interval);
+
+  int tfd = timerfd_create(DDHCP_CLOCK, TFD_NONBLOCK | TFD_CLOEXEC);
 
-  if (early_housekeeping) {
-    loop_timeout = 0;
+  if (tfd == -1) {
+    perror("timerfd_create");
+    abort();
   }
 
-  INFO("loop timeout: %i msecs\n", get_loop_timeout(config));
+  add_fd(efd, tfd, EPOLLIN | EPOLLET);
 
-  // TODO wait loop_timeout before first time housekeeping
-  struct sockaddr_in6 sender;
-  socklen_t sender_len = sizeof sender;
+  time_t armed = schedule_house_keeping(config);
+  arm_timer(tfd, armed);
 
   do {
-    int n = epoll_wait(efd, events, maxevents, loop_timeout);
+    int n = epoll_wait(efd, events, maxevents, -1);
+    clock_update();
 
     if (n < 0) {
       perror("epoll error:");
     }
 
-#if LOG_LEVEL >= LOG_DEBUG
-
-    if (loop_timeout != config->loop_timeout) {
-      DEBUG("Increase loop timeout from %i to %i\n", loop_timeout, config->loop_timeout);
-    }
-
-#endif
-
-    loop_timeout = config->loop_timeout;
-    need_house_keeping = 1;
+    need_house_keeping = 0;
 
     for (int i = 0; i < n; i++) {
       if ((events[i].events & EPOLLERR) ) {
         ERROR("Error in epoll: %i \n", errno);
         exit(1);
+      } else if (tfd == events[i].data.fd) {
+        uint64_t expirations;
+
+        if (read(tfd, &expirations, sizeof(expirations)) > 0) {
+          config->wakeups++;
+        }
+
+        // The timer fired and needs to be armed again.
+        armed = 0;
       } else if (config->server_socket == events[i].data.fd) {
         // DDHCP Roamed DHCP Requests
-        int len;
+        int count;
 
-        while ((len = recvfrom(events[i].data.fd, buffer, 1500, 0, (struct sockaddr*) &sender, &sender_len)) > 0) {
+        do {
+          count = batch_recv(events[i].data.fd, batch, &config->server_recv);
+
+          for (int k = 0; k < count; k++) {
 #if LOG_LEVEL >= LOG_DEBUG
-          char ipv6_sender[INET6_ADDRSTRLEN];
-          DEBUG("Receive message from %s\n",
-                inet_ntop(AF_INET6, get_in_addr((struct sockaddr*)&sender), ipv6_sender, INET6_ADDRSTRLEN));
+            char ipv6_sender[INET6_ADDRSTRLEN];
+            DEBUG("Receive message from %s\n",
+                  inet_ntop(AF_INET6, get_in_addr((struct sockaddr*) &batch_sender(batch, k)), ipv6_sender, INET6_ADDRSTRLEN));
 #endif
-          ddhcp_dhcp_process(buffer, len, sender, config);
-        }
+            ddhcp_dhcp_process(batch_buffer(batch, k), batch_len(batch, k), batch_sender(batch, k), config);
+          }
+        } while (count == BATCH_SIZE);
       } else if (config->mcast_socket == events[i].data.fd) {
         // DDHCP Block Handling
-        int len;
+        int count;
 
-        while ((len = recvfrom(events[i].data.fd, buffer, 1500, 0, (struct sockaddr*) &sender, &sender_len)) > 0) {
+        do {
+          count = batch_recv(events[i].data.fd, batch, &config->mcast_recv);
+
+          for (int k = 0; k < count; k++) {
 #if LOG_LEVEL >= LOG_DEBUG
-          char ipv6_sender[INET6_ADDRSTRLEN];
-          DEBUG("Receive message from %s\n",
-                inet_ntop(AF_INET6, get_in_addr((struct sockaddr*)&sender), ipv6_sender, INET6_ADDRSTRLEN));
+            char ipv6_sender[INET6_ADDRSTRLEN];
+            DEBUG("Receive message from %s\n",
+                  inet_ntop(AF_INET6, get_in_addr((struct sockaddr*) &batch_sender(batch, k)), ipv6_sender, INET6_ADDRSTRLEN));
 #endif
-          ddhcp_block_process(buffer, len, sender, config);
-        }
-
-        house_keeping(config);
-        need_house_keeping = 0;
+            ddhcp_block_process(batch_buffer(batch, k), batch_len(batch, k), batch_sender(batch, k), config);
+          }
+        } while (count == BATCH_SIZE);
       } else if (config->client_socket == events[i].data.fd) {
         // DHCP
-        int len;
+        int count;
 
-        while ((len = read(config->client_socket, buffer, 1500)) > 0) {
-          need_house_keeping = need_house_keeping | dhcp_process(buffer, len, config);
-        }
+        do {
+          count = batch_recv(config->client_socket, batch, &config->client_recv);
+
+          for (int k = 0; k < count; k++) {
+            need_house_keeping = need_house_keeping | dhcp_process(batch_buffer(batch, k), batch_len(batch, k), config);
+          }
+        } while (count == BATCH_SIZE);
       } else if (config->control_socket == events[i].data.fd) {
         // Handle new control socket connections
         struct sockaddr_un client_fd;
@@ -440,14 +570,31 @@ int main(int argc, char** argv) {
       }
     }
 
-    if (need_house_keeping) {
+    if (need_house_keeping || (config->next_wakeup != 0 && clock_now() >= config->next_wakeup)) {
       house_keeping(config);
     }
+
+    flush_queue(efd, &config->mcast_queue);
+    flush_queue(efd, &config->server_queue);
+    flush_queue(efd, &config->client_queue);
+
+    time_t wakeup = schedule_house_keeping(config);
+
+    if (wakeup != armed) {
+      DEBUG("Next house keeping at %li\n", (long) wakeup);
+      arm_timer(tfd, wakeup);
+      armed = wakeup;
+    }
   } while (daemon_running);
 
   // TODO free dhcp_leases
+  close(tfd);
   free(events);
   free(buffer);
+  batch_free(batch);
+  batch_queue_free(&config->mcast_queue);
+  batch_queue_free(&config->server_queue);
+  batch_queue_free(&config->client_queue);
 
   ddhcp_block_free(config);
 
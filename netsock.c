@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <net/ethernet.h>
 #include <net/if.h>
+#include <net/if_arp.h>
 #include <netinet/in.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -155,6 +156,15 @@ int netsock_open(char* interface, char* interface_client, ddhcp_config* state)
   uint32_t scope_id = ifr.ifr_ifindex;
   state->mcast_scope_id = ifr.ifr_ifindex;
 
+  // Block messages are split to fit the interface, IPv6 requires at least 1280.
+  state->mcast_mtu = 1280;
+
+  if (ioctl(sock_srv, SIOCGIFMTU, &ifr) == -1) {
+    perror("can't get MTU, assuming 1280");
+  } else if (ifr.ifr_mtu > 1280) {
+    state->mcast_mtu = ifr.ifr_mtu;
+  }
+
   if (ioctl(sock_srv, SIOCGIFHWADDR, &ifr) == -1) {
     perror("can't get MAC address");
     goto err;
@@ -338,6 +348,24 @@ int netsock_openv4(char* interface_client, ddhcp_config* config) {
     return -1;
   }
   config->client_socket = sock;
+  strncpy(config->client_interface, interface_client, IFNAMSIZ - 1);
 
   return 0;
 }
+
+int netsock_neigh_add(int socket, struct in_addr* address, uint8_t* hwaddr, ddhcp_config* state) {
+  struct arpreq req;
+  memset(&req, 0, sizeof(req));
+
+  struct sockaddr_in* protocol_address = (struct sockaddr_in*) &req.arp_pa;
+  protocol_address->sin_family = AF_INET;
+  memcpy(&protocol_address->sin_addr, address, sizeof(struct in_addr));
+
+  req.arp_ha.sa_family = ARPHRD_ETHER;
+  memcpy(req.arp_ha.sa_data, hwaddr, ETH_ALEN);
+  // A complete but not permanent entry, the kernel ages it out as usual.
+  req.arp_flags = ATF_COM;
+  strncpy(req.arp_dev, state->client_interface, sizeof(req.arp_dev) - 1);
+
+  return ioctl(socket, SIOCSARP, &req);
+}
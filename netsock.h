@@ -10,4 +10,11 @@ int control_open(ddhcp_config* state);
 int control_connect(ddhcp_config* state);
 int netsock_open(char* interface, char* interface_client, ddhcp_config* state);
 
+/**
+ * Add a neighbour entry mapping address to the ethernet address hwaddr on
+ * the client interface, so we can send to a client which has not yet
+ * configured its address. Returns 0 on success.
+ */
+int netsock_neigh_add(int socket, struct in_addr* address, uint8_t* hwaddr, ddhcp_config* state);
+
 #endif
@@ -1,4 +1,5 @@
 #include "packet.h"
+#include "batch.h"
 #include "logger.h"
 #include "netsock.h"
 
@@ -25,17 +26,21 @@ int _packet_size(int command, int payload_count) {
 
   switch (command) {
   case DDHCP_MSG_UPDATECLAIM:
-    len = 16 + payload_count * 7;
+    len = DDHCP_HEADER_LEN + payload_count * 7;
     break;
 
   case DDHCP_MSG_INQUIRE:
-    len = 16 + payload_count * 4;
+    len = DDHCP_HEADER_LEN + payload_count * 4;
+    break;
+
+  case DDHCP_MSG_UPDATECLAIM_RANGES:
+    len = DDHCP_HEADER_LEN + payload_count * 8;
     break;
 
   case DDHCP_MSG_LEASEACK:
   case DDHCP_MSG_LEASENAK:
   case DDHCP_MSG_RENEWLEASE:
-    len = 16 + sizeof(struct ddhcp_renew_payload);
+    len = DDHCP_HEADER_LEN + sizeof(struct ddhcp_renew_payload);
 
     break;
 
@@ -67,6 +72,7 @@ struct ddhcp_mcast_packet* new_ddhcp_packet(int command, ddhcp_config* config) {
 }
 
 int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packet) {
+  uint8_t count;
 
   // Header
   copy_buf_to_var_inc(buffer, ddhcp_node_id, packet->node_id);
@@ -82,7 +88,8 @@ int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packe
   // the command
   copy_buf_to_var_inc(buffer, uint8_t, packet->command);
   // count of payload entries
-  copy_buf_to_var_inc(buffer, uint8_t, packet->count);
+  copy_buf_to_var_inc(buffer, uint8_t, count);
+  packet->count = count;
 
   int should_len = _packet_size(packet->command, packet->count);
 
@@ -114,7 +121,7 @@ int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packe
     packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), packet->count);
     payload = packet->payload;
 
-    for (int i = 0; i < packet->count; i++) {
+    for (uint32_t i = 0; i < packet->count; i++) {
       copy_buf_to_var_inc(buffer, uint32_t, tmp32);
       payload->block_index = ntohl(tmp32);
 
@@ -123,7 +130,28 @@ int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packe
 
       copy_buf_to_var_inc(buffer, uint8_t, tmp8);
       payload->reserved = tmp8;
+      payload->length = 1;
+
+      payload++;
+    }
+
+    break;
+
+  case DDHCP_MSG_UPDATECLAIM_RANGES:
+    packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), packet->count);
+    payload = packet->payload;
+
+    for (uint32_t i = 0; i < packet->count; i++) {
+      copy_buf_to_var_inc(buffer, uint32_t, tmp32);
+      payload->block_index = ntohl(tmp32);
 
+      copy_buf_to_var_inc(buffer, uint16_t, tmp16);
+      payload->length = ntohs(tmp16);
+
+      copy_buf_to_var_inc(buffer, uint16_t, tmp16);
+      payload->timeout = ntohs(tmp16);
+
+      payload->reserved = DDHCP_CLAIM_CAP_RANGES;
       payload++;
     }
 
@@ -134,7 +162,7 @@ int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packe
     packet->payload = (struct ddhcp_payload*) calloc(sizeof(struct ddhcp_payload), packet->count);
     payload = packet->payload;
 
-    for (int i = 0; i < packet->count; i++) {
+    for (uint32_t i = 0; i < packet->count; i++) {
       copy_buf_to_var_inc(buffer, uint32_t, tmp32);
       payload->block_index = ntohl(tmp32);
 
@@ -168,6 +196,8 @@ int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packe
 }
 
 int hton_packet(struct ddhcp_mcast_packet* packet, char* buffer) {
+  assert(packet->count <= DDHCP_MAX_ENTRIES);
+  uint8_t count = packet->count;
 
   // Header
   copy_var_to_buf_inc(buffer, ddhcp_node_id, packet->node_id);
@@ -183,7 +213,7 @@ int hton_packet(struct ddhcp_mcast_packet* packet, char* buffer) {
   // the command
   copy_var_to_buf_inc(buffer, uint8_t, packet->command);
   // count of payload entries
-  copy_var_to_buf_inc(buffer, uint8_t, packet->count);
+  copy_var_to_buf_inc(buffer, uint8_t, count);
 
   uint8_t tmp8;
   uint16_t tmp16;
@@ -221,6 +251,24 @@ int hton_packet(struct ddhcp_mcast_packet* packet, char* buffer) {
 
     break;
 
+  case DDHCP_MSG_UPDATECLAIM_RANGES:
+    payload = packet->payload;
+
+    for (unsigned int index = 0; index < packet->count; index++) {
+      tmp32 = htonl(payload->block_index);
+      copy_var_to_buf_inc(buffer, uint32_t, tmp32);
+
+      tmp16 = htons(payload->length);
+      copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+
+      tmp16 = htons(payload->timeout);
+      copy_var_to_buf_inc(buffer, uint16_t, tmp16);
+
+      payload++;
+    }
+
+    break;
+
   case DDHCP_MSG_LEASEACK:
   case DDHCP_MSG_LEASENAK:
   case DDHCP_MSG_RELEASE:
@@ -241,19 +289,9 @@ int hton_packet(struct ddhcp_mcast_packet* packet, char* buffer) {
   return 0;
 }
 
-int send_packet_mcast(struct ddhcp_mcast_packet* packet, int mulitcast_socket, uint32_t scope_id) {
+int send_packet_mcast(struct ddhcp_mcast_packet* packet, ddhcp_send_queue* queue, uint32_t scope_id) {
   int len = _packet_size(packet->command, packet->count);
 
-  char* buffer = (char*) calloc(1, len);
-
-  if (buffer == NULL) {
-    return 1;
-  }
-
-  errno = 0;
-
-  hton_packet(packet, buffer);
-
   struct sockaddr_in6 dest_addr = {
     .sin6_family = AF_INET6,
     .sin6_port = htons(DDHCP_MULTICAST_PORT),
@@ -274,24 +312,21 @@ int send_packet_mcast(struct ddhcp_mcast_packet* packet, int mulitcast_socket, u
 
   memcpy(&dest_addr.sin6_addr, &dest, sizeof(dest));
 
-  sendto(mulitcast_socket, buffer, len, 0, (struct sockaddr*) &dest_addr, sizeof(dest_addr));
+  uint8_t* buffer = batch_queue_push(queue, len, (struct sockaddr*) &dest_addr, sizeof(dest_addr));
 
-  free(buffer);
+  if (buffer == NULL) {
+    return 1;
+  }
+
+  hton_packet(packet, (char*) buffer);
 
   return 0;
 }
 
-int send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest, int multicast_socket, uint32_t scope_id) {
-  DEBUG("send_packet_direct(packet,%i)\n", multicast_socket);
+int send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest, ddhcp_send_queue* queue, uint32_t scope_id) {
+  DEBUG("send_packet_direct(packet,%i)\n", queue->socket);
   int len = _packet_size(packet->command, packet->count);
 
-  char* buffer = (char*) calloc(1, len);
-
-  if (buffer == NULL) {
-    ERROR("send_packet_direct( ... ) -> Failure\n");
-    return 1;
-  }
-
   struct sockaddr_in6 dest_addr = {
     .sin6_family = AF_INET6,
     .sin6_port = htons(DDHCP_UNICAST_PORT),
@@ -308,12 +343,151 @@ int send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest,
 
 #endif
 
-  hton_packet(packet, buffer);
+  uint8_t* buffer = batch_queue_push(queue, len, (struct sockaddr*) &dest_addr, sizeof(struct sockaddr_in6));
 
-  // TODO Error handling
-  sendto(multicast_socket, buffer, len, 0, (struct sockaddr*) &dest_addr, sizeof(struct sockaddr_in6));
+  if (buffer == NULL) {
+    ERROR("send_packet_direct( ... ) -> Failure\n");
+    return 1;
+  }
 
-  free(buffer);
+  hton_packet(packet, (char*) buffer);
 
   return 0;
 }
+
+int send_packet_mcast_batch(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+  DEBUG("send_packet_mcast_batch(packet, config)\n");
+  assert(packet->command == DDHCP_MSG_UPDATECLAIM || packet->command == DDHCP_MSG_INQUIRE || packet->command == DDHCP_MSG_UPDATECLAIM_RANGES);
+
+  int entry_len = _packet_size(packet->command, 1) - _packet_size(packet->command, 0);
+  int room = (int) config->mcast_mtu - DDHCP_IPV6_UDP_HEADER_LEN - DDHCP_HEADER_LEN;
+  uint32_t per_datagram = room > entry_len ? room / entry_len : 1;
+
+  if (per_datagram > DDHCP_MAX_ENTRIES) {
+    per_datagram = DDHCP_MAX_ENTRIES;
+  }
+
+  uint32_t count = packet->count;
+  struct ddhcp_payload* payload = packet->payload;
+  int datagrams = 0;
+  int ret = 0;
+
+  // Send slices of the payload, each in a datagram of its own.
+  for (uint32_t offset = 0; offset < count; offset += packet->count) {
+    packet->payload = payload + offset;
+    packet->count = count - offset < per_datagram ? count - offset : per_datagram;
+
+    if (packet->command == DDHCP_MSG_UPDATECLAIM_RANGES) {
+      uint32_t blocks = 0;
+
+      for (uint32_t i = 0; i < packet->count; i++) {
+        blocks += packet->payload[i].length;
+
+        if (blocks > DDHCP_CLAIM_MAX_BLOCKS) {
+          packet->count = i;
+          break;
+        }
+      }
+    }
+
+    if (send_packet_mcast(packet, &config->mcast_queue, config->mcast_scope_id) > 0) {
+      ret = -1;
+      break;
+    }
+
+    datagrams++;
+    config->block_messages.bytes += _packet_size(packet->command, packet->count);
+  }
+
+  packet->payload = payload;
+  packet->count = count;
+
+  config->block_messages.messages++;
+  config->block_messages.datagrams += datagrams;
+  config->block_messages.entries += count;
+
+  if (packet->command == DDHCP_MSG_UPDATECLAIM_RANGES) {
+    config->block_messages.ranges += count;
+  }
+
+  if ((uint32_t) datagrams > config->block_messages.largest) {
+    config->block_messages.largest = datagrams;
+  }
+
+  DEBUG("send_packet_mcast_batch( ... ) -> %u entries in %i datagrams of up to %u\n", count, datagrams, per_datagram);
+
+  return ret < 0 ? ret : datagrams;
+}
+
+int _packet_payload_cmp(const void* a, const void* b) {
+  uint32_t index_a = ((const struct ddhcp_payload*) a)->block_index;
+  uint32_t index_b = ((const struct ddhcp_payload*) b)->block_index;
+  return (index_a > index_b) - (index_a < index_b);
+}
+
+void packet_compress_claims(struct ddhcp_mcast_packet* packet) {
+  assert(packet->command == DDHCP_MSG_UPDATECLAIM);
+
+  if (packet->count == 0) {
+    packet->command = DDHCP_MSG_UPDATECLAIM_RANGES;
+    return;
+  }
+
+  struct ddhcp_payload* payload = packet->payload;
+  qsort(payload, packet->count, sizeof(struct ddhcp_payload), _packet_payload_cmp);
+
+  // Count the ranges first, a range entry is larger than a single claim.
+  struct ddhcp_payload* first = payload;
+  uint32_t ranges = 1;
+  uint32_t length = 1;
+
+  for (uint32_t i = 1; i < packet->count; i++) {
+    if (payload[i].block_index < first->block_index + length) {
+      continue;
+    }
+
+    if (payload[i].block_index == first->block_index + length
+        && payload[i].timeout == first->timeout && length < DDHCP_CLAIM_MAX_BLOCKS) {
+      length++;
+    } else {
+      first = payload + i;
+      ranges++;
+      length = 1;
+    }
+  }
+
+  if (_packet_size(DDHCP_MSG_UPDATECLAIM_RANGES, ranges) >= _packet_size(DDHCP_MSG_UPDATECLAIM, packet->count)) {
+    return;
+  }
+
+  // Runs are merged into the entry of their first block.
+  struct ddhcp_payload* run = payload;
+  run->length = 1;
+
+  for (uint32_t i = 1; i < packet->count; i++) {
+    if (payload[i].block_index < run->block_index + run->length) {
+      continue;
+    }
+
+    if (payload[i].block_index == run->block_index + run->length
+        && payload[i].timeout == run->timeout && run->length < DDHCP_CLAIM_MAX_BLOCKS) {
+      run->length++;
+    } else {
+      *(++run) = payload[i];
+      run->length = 1;
+    }
+  }
+
+  packet->count = run - payload + 1;
+  packet->command = DDHCP_MSG_UPDATECLAIM_RANGES;
+}
+
+void send_packet_show_status(int fd, ddhcp_config* config) {
+  dprintf(fd, "block messages\n");
+  dprintf(fd, "      mtu\t%u\n", config->mcast_mtu);
+  dprintf(fd, "      messages/datagrams/entries\t%lu/%lu/%lu\n", (unsigned long) config->block_messages.messages, (unsigned long) config->block_messages.datagrams, (unsigned long) config->block_messages.entries);
+  dprintf(fd, "      bytes\t%lu\n", (unsigned long) config->block_messages.bytes);
+  dprintf(fd, "      range entries\t%lu\n", (unsigned long) config->block_messages.ranges);
+  dprintf(fd, "      oversized claims received\t%lu\n", (unsigned long) config->block_messages.oversized);
+  dprintf(fd, "      largest message\t%u datagrams\n", config->block_messages.largest);
+}
@@ -24,11 +24,25 @@
 
 #define DDHCP_MSG_UPDATECLAIM 1
 #define DDHCP_MSG_INQUIRE 2
+// UPDATECLAIM of runs of consecutive blocks, only sent if all nodes support it.
+#define DDHCP_MSG_UPDATECLAIM_RANGES 3
 #define DDHCP_MSG_RENEWLEASE 16
 #define DDHCP_MSG_LEASEACK 17
 #define DDHCP_MSG_LEASENAK 18
 #define DDHCP_MSG_RELEASE 19
 
+// Size of the header of a datagram and the headers below it.
+#define DDHCP_HEADER_LEN 16
+#define DDHCP_IPV6_UDP_HEADER_LEN (40 + 8)
+// Entries in a datagram, limited by its count field.
+#define DDHCP_MAX_ENTRIES 255
+
+// Flag in the reserved field of claims, the sender understands range encoded claims.
+#define DDHCP_CLAIM_CAP_RANGES 0x01
+// Blocks a single datagram may claim, no more than entries of the plain encoding.
+// Bigger claims are dropped instead of materializing the block table.
+#define DDHCP_CLAIM_MAX_BLOCKS DDHCP_MAX_ENTRIES
+
 
 struct ddhcp_mcast_packet {
   ddhcp_node_id node_id;
@@ -36,7 +50,8 @@ struct ddhcp_mcast_packet {
   uint8_t prefix_len;
   uint8_t blocksize;
   uint8_t command;
-  uint8_t count;
+  // On the wire the count of a datagram is a single byte.
+  uint32_t count;
 
   struct sockaddr_in6* sender;
 
@@ -51,6 +66,8 @@ struct ddhcp_payload {
   uint32_t block_index;
   uint16_t timeout;
   uint16_t reserved;
+  // Number of consecutive blocks starting at block_index, 1 unless range encoded.
+  uint16_t length;
 };
 typedef struct ddhcp_payload ddhcp_payload;
 
@@ -66,7 +83,33 @@ typedef struct ddhcp_renew_payload ddhcp_renew_payload;
 struct ddhcp_mcast_packet* new_ddhcp_packet(int command, ddhcp_config* config);
 int ntoh_mcast_packet(uint8_t* buffer, int len, struct ddhcp_mcast_packet* packet);
 
-int send_packet_mcast(struct ddhcp_mcast_packet* packet, int mulitcast_socket, uint32_t scope_id);
-int send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest, int multicast_socket, uint32_t scope_id);
+/**
+ * Queue a packet to the multicast group or to a single node, the datagram
+ * is sent with the next flush of queue.
+ */
+int send_packet_mcast(struct ddhcp_mcast_packet* packet, ddhcp_send_queue* queue, uint32_t scope_id);
+int send_packet_direct(struct ddhcp_mcast_packet* packet, struct in6_addr* dest, ddhcp_send_queue* queue, uint32_t scope_id);
+
+/**
+ * Queue an UPDATECLAIM or INQUIRE packet with any number of entries to the
+ * multicast group, split into as many datagrams as needed for each to fit
+ * the mtu of the server interface and to claim at most DDHCP_CLAIM_MAX_BLOCKS.
+ * Returns the number of datagrams queued, or -1 on failure.
+ */
+int send_packet_mcast_batch(struct ddhcp_mcast_packet* packet, ddhcp_config* config);
+
+/**
+ * Turn the claims of an UPDATECLAIM packet into an UPDATECLAIM_RANGES packet,
+ * merging runs of consecutive blocks with the same timeout into ranges of up
+ * to DDHCP_CLAIM_MAX_BLOCKS blocks. Duplicate claims of a block are dropped.
+ * The payload is sorted and rewritten in place. Claims which would not
+ * shrink, like those of scattered blocks, stay an UPDATECLAIM packet.
+ */
+void packet_compress_claims(struct ddhcp_mcast_packet* packet);
+
+/**
+ * Print the statistics of batched block messages into given file descriptor.
+ */
+void send_packet_show_status(int fd, ddhcp_config* config);
 
 #endif
@@ -0,0 +1,116 @@
+#include "peer.h"
+
+#include "clock.h"
+#include "logger.h"
+
+void _peer_expire(ddhcp_config* config) {
+  time_t now = clock_now();
+
+  for (uint32_t i = 0; i < config->peers_len;) {
+    if (config->peers[i].last_seen + config->block_timeout < now) {
+      // Keep the table dense, order does not matter.
+      config->peers[i] = config->peers[--config->peers_len];
+    } else {
+      i++;
+    }
+  }
+}
+
+void peer_seen(struct ddhcp_mcast_packet* packet, ddhcp_config* config) {
+  time_t now = clock_now();
+  ddhcp_peer* peer = NULL;
+  int capable = -1;
+
+  if (packet->command == DDHCP_MSG_UPDATECLAIM_RANGES) {
+    capable = 1;
+  } else if (packet->command == DDHCP_MSG_UPDATECLAIM && packet->count > 0) {
+    capable = (packet->payload[0].reserved & DDHCP_CLAIM_CAP_RANGES) != 0;
+  }
+
+  for (uint32_t i = 0; i < config->peers_len; i++) {
+    if (NODE_ID_CMP(config->peers[i].node_id, packet->node_id) == 0) {
+      peer = config->peers + i;
+      break;
+    }
+  }
+
+  if (peer == NULL) {
+    _peer_expire(config);
+
+    if (config->peers_len == DDHCP_PEERS) {
+      DEBUG("peer_seen(...): peer table full\n");
+      config->peers_overflow = now;
+      return;
+    }
+
+    peer = config->peers + config->peers_len++;
+    NODE_ID_CP(peer->node_id, packet->node_id);
+    peer->capable = 0;
+  }
+
+  // Inquires do not tell about the capabilities.
+  if (capable >= 0) {
+    peer->capable = capable;
+  }
+
+  peer->last_seen = now;
+}
+
+int peer_all_support_ranges(ddhcp_config* config) {
+  // Some node we did not keep track of might not.
+  if (config->peers_overflow != 0 && config->peers_overflow + config->block_timeout >= clock_now()) {
+    return 0;
+  }
+
+  _peer_expire(config);
+
+  for (uint32_t i = 0; i < config->peers_len; i++) {
+    if (!config->peers[i].capable) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+uint32_t peer_rank(ddhcp_config* config, uint32_t* nodes) {
+  uint32_t rank = 0;
+
+  _peer_expire(config);
+  *nodes = 1;
+
+  for (uint32_t i = 0; i < config->peers_len; i++) {
+    int cmp = NODE_ID_CMP(config->peers[i].node_id, config->node_id);
+
+    // Our own claims may be looped back to us.
+    if (cmp == 0) {
+      continue;
+    }
+
+    rank += cmp < 0;
+    (*nodes)++;
+  }
+
+  return rank;
+}
+
+void peer_show_status(int fd, ddhcp_config* config) {
+  time_t now = clock_now();
+  char node_id[17];
+
+  dprintf(fd, "peers\n");
+  dprintf(fd, "node id\t\t\tranges\tlast seen\n");
+
+  for (uint32_t i = 0; i < config->peers_len; i++) {
+    ddhcp_peer* peer = config->peers + i;
+
+    for (uint32_t j = 0; j < 8; j++) {
+      sprintf(node_id + 2 * j, "%02X", peer->node_id[j]);
+    }
+
+    node_id[16] = '\0';
+    dprintf(fd, "%s\t%i\t%li\n", node_id, peer->capable, (long) (now - peer->last_seen));
+  }
+
+  dprintf(fd, "      range encoding\t%s\n", peer_all_support_ranges(config) ? "on" : "off");
+}
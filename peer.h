@@ -0,0 +1,38 @@
+#ifndef _PEER_H
+#define _PEER_H
+
+#include "types.h"
+#include "packet.h"
+
+/**
+ * The nodes we heard of on the multicast group and whether they understand
+ * range encoded claims.
+ *
+ * A node announces the capability with the DDHCP_CLAIM_CAP_RANGES flag in
+ * its claims, or by sending range encoded claims. Nodes we only heard
+ * inquiring from, and nodes not fitting into the table, are assumed to be
+ * legacy nodes. A node is forgotten once it was silent for a block timeout.
+ */
+
+/**
+ * Note a block message received from another node.
+ */
+void peer_seen(struct ddhcp_mcast_packet* packet, ddhcp_config* config);
+
+/**
+ * Do all nodes we currently know understand range encoded claims.
+ */
+int peer_all_support_ranges(ddhcp_config* config);
+
+/**
+ * Return the number of known nodes whose node id orders before ours and set
+ * nodes to the number of known nodes, ourselves included.
+ */
+uint32_t peer_rank(ddhcp_config* config, uint32_t* nodes);
+
+/**
+ * Print the known nodes into given file descriptor.
+ */
+void peer_show_status(int fd, ddhcp_config* config);
+
+#endif
@@ -0,0 +1,186 @@
+#include "scan.h"
+
+#include <string.h>
+
+#define SCAN_BYTES_ONE 0x0101010101010101ULL
+#define SCAN_BYTES_LOW 0x7F7F7F7F7F7F7F7FULL
+
+/**
+ * Return a word with the high bit set in exactly those bytes of word which
+ * are equal to value.
+ */
+static inline uint64_t _scan_match(uint64_t word, uint8_t value) {
+  uint64_t x = word ^ (SCAN_BYTES_ONE * value);
+  return ~(((x & SCAN_BYTES_LOW) + SCAN_BYTES_LOW) | x | SCAN_BYTES_LOW);
+}
+
+/**
+ * Return the position of the first byte marked in a non zero match word.
+ */
+static inline uint32_t _scan_first(uint64_t match) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_ctzll(match) / 8;
+#else
+  return __builtin_clzll(match) / 8;
+#endif
+}
+
+uint32_t _scan_find_word(const uint8_t* bytes, uint32_t len, uint8_t value, int other) {
+  uint32_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    uint64_t match = _scan_match(word, value);
+
+    if (other) {
+      match ^= ~SCAN_BYTES_LOW;
+    }
+
+    if (match) {
+      return i + _scan_first(match);
+    }
+  }
+
+  for (; i < len; i++) {
+    if ((bytes[i] == value) != other) {
+      return i;
+    }
+  }
+
+  return len;
+}
+
+uint32_t _scan_count_word(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  uint32_t num = 0;
+  uint32_t i = 0;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    num += __builtin_popcountll(_scan_match(word, value));
+  }
+
+  for (; i < len; i++) {
+    num += bytes[i] == value;
+  }
+
+  return num;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+__attribute__((target("sse2")))
+uint32_t _scan_find_sse2(const uint8_t* bytes, uint32_t len, uint8_t value, int other) {
+  __m128i needle = _mm_set1_epi8((char) value);
+  uint32_t flip = other ? 0xFFFF : 0;
+  uint32_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + i));
+    uint32_t mask = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)) ^ flip;
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + _scan_find_word(bytes + i, len - i, value, other);
+}
+
+__attribute__((target("sse2")))
+uint32_t _scan_count_sse2(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  __m128i needle = _mm_set1_epi8((char) value);
+  uint32_t num = 0;
+  uint32_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(bytes + i));
+    num += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)));
+  }
+
+  return num + _scan_count_word(bytes + i, len - i, value);
+}
+
+__attribute__((target("avx2")))
+uint32_t _scan_find_avx2(const uint8_t* bytes, uint32_t len, uint8_t value, int other) {
+  __m256i needle = _mm256_set1_epi8((char) value);
+  uint32_t flip = other ? 0xFFFFFFFF : 0;
+  uint32_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(bytes + i));
+    uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)) ^ flip;
+
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+
+  return i + _scan_find_sse2(bytes + i, len - i, value, other);
+}
+
+__attribute__((target("avx2")))
+uint32_t _scan_count_avx2(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  __m256i needle = _mm256_set1_epi8((char) value);
+  uint32_t num = 0;
+  uint32_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(bytes + i));
+    num += __builtin_popcount((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+  }
+
+  return num + _scan_count_sse2(bytes + i, len - i, value);
+}
+#endif
+
+uint32_t _scan_find_dispatch(const uint8_t* bytes, uint32_t len, uint8_t value, int other);
+uint32_t _scan_count_dispatch(const uint8_t* bytes, uint32_t len, uint8_t value);
+
+uint32_t (*_scan_find)(const uint8_t*, uint32_t, uint8_t, int) = _scan_find_dispatch;
+uint32_t (*_scan_count)(const uint8_t*, uint32_t, uint8_t) = _scan_count_dispatch;
+
+/**
+ * Select the kernels supported by this cpu.
+ */
+void _scan_select(void) {
+  _scan_find = _scan_find_word;
+  _scan_count = _scan_count_word;
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+    _scan_find = _scan_find_avx2;
+    _scan_count = _scan_count_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    _scan_find = _scan_find_sse2;
+    _scan_count = _scan_count_sse2;
+  }
+
+#endif
+}
+
+uint32_t _scan_find_dispatch(const uint8_t* bytes, uint32_t len, uint8_t value, int other) {
+  _scan_select();
+  return _scan_find(bytes, len, value, other);
+}
+
+uint32_t _scan_count_dispatch(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  _scan_select();
+  return _scan_count(bytes, len, value);
+}
+
+uint32_t scan_count(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  return _scan_count(bytes, len, value);
+}
+
+uint32_t scan_find(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  return _scan_find(bytes, len, value, 0);
+}
+
+uint32_t scan_find_other(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  return _scan_find(bytes, len, value, 1);
+}
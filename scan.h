@@ -0,0 +1,29 @@
+#ifndef _SCAN_H
+#define _SCAN_H
+
+#include <stdint.h>
+
+/**
+ * Kernels searching and counting bytes in dense state arrays.
+ *
+ * On x86 SSE2 or AVX2 compare and movemask instructions are used, selected
+ * at runtime on the first call. Other architectures fall back to a portable
+ * implementation comparing eight bytes per step.
+ */
+
+/**
+ * Return the number of bytes equal to value.
+ */
+uint32_t scan_count(const uint8_t* bytes, uint32_t len, uint8_t value);
+
+/**
+ * Return the index of the first byte equal to value, or len if there is none.
+ */
+uint32_t scan_find(const uint8_t* bytes, uint32_t len, uint8_t value);
+
+/**
+ * Return the index of the first byte not equal to value, or len if there is none.
+ */
+uint32_t scan_find_other(const uint8_t* bytes, uint32_t len, uint8_t value);
+
+#endif
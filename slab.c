@@ -0,0 +1,109 @@
+#include "slab.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+int _slab_owns(ddhcp_slab* slab, void* chunk) {
+  uint8_t* c = (uint8_t*) chunk;
+  return c >= slab->chunks && c < slab->chunks + slab->chunk_size * slab->slab_chunks;
+}
+
+void _slab_push(ddhcp_slab* slab, void* chunk) {
+  memcpy(chunk, &slab->free, sizeof(void*));
+  slab->free = chunk;
+  slab->num_free++;
+}
+
+int slab_init(ddhcp_slab* slab, size_t chunk_size, uint32_t slab_chunks, uint32_t cache_limit) {
+  DEBUG("slab_init(slab, %lu, %u, %u)\n", (unsigned long) chunk_size, slab_chunks, cache_limit);
+  memset(slab, 0, sizeof(ddhcp_slab));
+
+  // Chunks hold the link of the free list and stay aligned for uint64_t.
+  if (chunk_size < sizeof(void*)) {
+    chunk_size = sizeof(void*);
+  }
+
+  slab->chunk_size = (chunk_size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+  slab->cache_limit = cache_limit;
+  slab->chunks = (uint8_t*) malloc(slab->chunk_size * slab_chunks);
+
+  if (slab->chunks == NULL && slab_chunks > 0) {
+    return 1;
+  }
+
+  slab->slab_chunks = slab_chunks;
+
+  for (uint32_t i = slab_chunks; i > 0; i--) {
+    _slab_push(slab, slab->chunks + (i - 1) * slab->chunk_size);
+  }
+
+  return 0;
+}
+
+void slab_free(ddhcp_slab* slab) {
+  while (slab->free) {
+    void* chunk = slab->free;
+    memcpy(&slab->free, chunk, sizeof(void*));
+
+    if (!_slab_owns(slab, chunk)) {
+      free(chunk);
+    }
+  }
+
+  free(slab->chunks);
+  memset(slab, 0, sizeof(ddhcp_slab));
+}
+
+void* slab_alloc(ddhcp_slab* slab) {
+  void* chunk = slab->free;
+
+  if (chunk) {
+    memcpy(&slab->free, chunk, sizeof(void*));
+    slab->num_free--;
+
+    if (!_slab_owns(slab, chunk)) {
+      slab->num_cached--;
+    }
+  } else {
+    chunk = malloc(slab->chunk_size);
+
+    if (chunk == NULL) {
+      return NULL;
+    }
+
+    slab->heap_allocs++;
+  }
+
+  memset(chunk, 0, slab->chunk_size);
+  slab->in_use++;
+  slab->allocs++;
+  return chunk;
+}
+
+void slab_release(ddhcp_slab* slab, void* chunk) {
+  slab->in_use--;
+  slab->releases++;
+
+  if (_slab_owns(slab, chunk)) {
+    _slab_push(slab, chunk);
+  } else if (slab->num_cached < slab->cache_limit) {
+    _slab_push(slab, chunk);
+    slab->num_cached++;
+  } else {
+    free(chunk);
+    slab->heap_frees++;
+  }
+}
+
+void slab_show_status(int fd, const char* name, ddhcp_slab* slab) {
+  dprintf(fd, "%s slab\n", name);
+  dprintf(fd, "      chunk size\t%lu\n", (unsigned long) slab->chunk_size);
+  dprintf(fd, "      slab chunks\t%u\n", slab->slab_chunks);
+  dprintf(fd, "      in use\t%u\n", slab->in_use);
+  dprintf(fd, "      free/cached\t%u/%u (cache limit %u)\n", slab->num_free, slab->num_cached, slab->cache_limit);
+  dprintf(fd, "      allocs/releases\t%lu/%lu\n", (unsigned long) slab->allocs, (unsigned long) slab->releases);
+  dprintf(fd, "      heap allocs/frees\t%lu/%lu\n", (unsigned long) slab->heap_allocs, (unsigned long) slab->heap_frees);
+}
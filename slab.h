@@ -0,0 +1,43 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "types.h"
+
+/**
+ * A fixed size allocator.
+ *
+ * A slab of chunks is allocated up front. Further chunks come from the heap
+ * once the slab is exhausted. Released chunks are kept for reuse: chunks of
+ * the slab always, heap chunks up to a bounded number, the rest is returned
+ * to the heap.
+ */
+
+/**
+ * Prepare a slab of slab_chunks chunks of chunk_size bytes, keeping at most
+ * cache_limit released heap chunks for reuse.
+ * Returns a value greater 0 if we are out of memory.
+ */
+int slab_init(ddhcp_slab* slab, size_t chunk_size, uint32_t slab_chunks, uint32_t cache_limit);
+
+/**
+ * Free the slab and all cached chunks.
+ * Chunks still in use must not be released afterwards.
+ */
+void slab_free(ddhcp_slab* slab);
+
+/**
+ * Return a zeroed chunk, or null if we are out of memory.
+ */
+void* slab_alloc(ddhcp_slab* slab);
+
+/**
+ * Give a chunk back to the slab.
+ */
+void slab_release(ddhcp_slab* slab, void* chunk);
+
+/**
+ * Print the usage of the slab.
+ */
+void slab_show_status(int fd, const char* name, ddhcp_slab* slab);
+
+#endif
@@ -0,0 +1,511 @@
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "clock.h"
+#include "dhcp.h"
+#include "packet.h"
+#include "timer.h"
+
+// Internals of dhcp.c
+void _dhcp_lease_set_state(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, ddhcp_config* config);
+// Internals of block.c
+uint32_t _block_index_select_free(uint32_t k, ddhcp_config* config);
+int _block_update_margin(ddhcp_config* config);
+
+#define BENCH_MAX_NODES 64
+#define BENCH_BLOCKS_PER_NODE 8
+#define BENCH_TRIALS 50
+// Blocks visited by every layout in each scan benchmark.
+#define BENCH_SCAN_VISITS (1 << 26)
+// Blocks in each claim set of the claim encoding benchmark.
+#define BENCH_CLAIM_BLOCKS 1024
+// Blocks owned one after another and hours they are kept in the claim
+// refresh benchmark.
+#define BENCH_REFRESH_BLOCKS 16
+#define BENCH_REFRESH_HOURS 4
+
+// The block before its state and timeout moved to the arrays of its page.
+struct bench_block_interleaved {
+  uint32_t index;
+  enum ddhcp_block_state state;
+  struct in_addr subnet;
+  uint8_t  subnet_len;
+  uint8_t claiming_counts;
+  ddhcp_node_id node_id;
+  struct in6_addr owner_address;
+  time_t timeout;
+  struct dhcp_lease* addresses;
+  ddhcp_timer timer;
+  ddhcp_timer lease_timer;
+  struct list_head list;
+};
+
+// The lease record before leases were packed.
+struct bench_lease_unpacked {
+  uint8_t chaddr[16];
+  enum dhcp_lease_state state;
+  uint32_t xid;
+  time_t lease_end;
+};
+
+/**
+ * Return the resident set size of the process in bytes.
+ */
+static long _bench_rss(void) {
+  long pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+
+  if (statm == NULL || fscanf(statm, "%*s %ld", &pages) != 1) {
+    pages = 0;
+  }
+
+  if (statm) {
+    fclose(statm);
+  }
+
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Return a monotonic time stamp in nanoseconds.
+ */
+static uint64_t _bench_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Count the claimed blocks which timed out, like the timeout scan does,
+ * over blocks blocks in the interleaved layout and in the state and
+ * timeout arrays of block pages.
+ */
+static void _bench_scan_layout(uint32_t blocks) {
+  uint32_t pages = blocks / BLOCK_PAGE_SIZE;
+  uint32_t repeat = BENCH_SCAN_VISITS / blocks;
+  struct bench_block_interleaved* interleaved = calloc(blocks, sizeof(struct bench_block_interleaved));
+  ddhcp_block_page* split = calloc(pages, sizeof(ddhcp_block_page));
+  time_t now = 60;
+  uint64_t found[2] = { 0 };
+  uint64_t ns[2];
+
+  if (interleaved == NULL || split == NULL) {
+    printf("      %u\tout of memory\n", blocks);
+    free(interleaved);
+    free(split);
+    return;
+  }
+
+  for (uint32_t index = 0; index < blocks; index++) {
+    ddhcp_block_page* page = split + index / BLOCK_PAGE_SIZE;
+    uint8_t state = rand() % 4 == 0 ? DDHCP_FREE : DDHCP_CLAIMED;
+    time_t timeout = rand() % 120;
+
+    interleaved[index].index = index;
+    interleaved[index].state = state;
+    interleaved[index].timeout = timeout;
+    page->blocks[BLOCK_PAGE_OFFSET(index)].index = index;
+    page->states[BLOCK_PAGE_OFFSET(index)] = state;
+    page->timeouts[BLOCK_PAGE_OFFSET(index)] = timeout;
+  }
+
+  uint64_t start = _bench_ns();
+
+  for (uint32_t r = 0; r < repeat; r++) {
+    for (uint32_t index = 0; index < blocks; index++) {
+      if (interleaved[index].state == DDHCP_CLAIMED && interleaved[index].timeout < now) {
+        found[0]++;
+      }
+    }
+  }
+
+  ns[0] = _bench_ns() - start;
+  start = _bench_ns();
+
+  for (uint32_t r = 0; r < repeat; r++) {
+    for (uint32_t p = 0; p < pages; p++) {
+      for (uint32_t i = 0; i < BLOCK_PAGE_SIZE; i++) {
+        if (split[p].states[i] == DDHCP_CLAIMED && split[p].timeouts[i] < now) {
+          found[1]++;
+        }
+      }
+    }
+  }
+
+  ns[1] = _bench_ns() - start;
+
+  printf("      %u\t%.2f\t\t%.2f\t\t%.1fx%s\n", blocks,
+         (double) ns[0] / BENCH_SCAN_VISITS, (double) ns[1] / BENCH_SCAN_VISITS, (double) ns[0] / ns[1],
+         found[0] == found[1] ? "" : "\tMISMATCH");
+
+  free(interleaved);
+  free(split);
+}
+
+/**
+ * Compare the timeout scan over 64k and 1M blocks in both block layouts.
+ */
+static void bench_scan_layout(void) {
+  printf("timeout scan, ns per block, %zu byte interleaved block, %zu byte arrays per block\n",
+         sizeof(struct bench_block_interleaved), sizeof(uint8_t) + sizeof(time_t));
+  printf("      blocks\tinterleaved\tarrays\t\tspeedup\n");
+  _bench_scan_layout(1 << 16);
+  _bench_scan_layout(1 << 20);
+}
+
+/**
+ * Lease every address of a /16 in blocks of 32 addresses and compare the
+ * memory used by both lease layouts. Block and client table are the same
+ * for both, only the lease arrays differ.
+ */
+static void bench_lease_memory(void) {
+  long before = _bench_rss();
+  ddhcp_config* config = test_config(16, 32);
+  uint32_t leases = config->number_of_blocks * config->block_size;
+
+  for (uint32_t index = 0; index < config->number_of_blocks; index++) {
+    ddhcp_block* block = block_materialize(index, config);
+    block_own(block, config);
+
+    for (uint32_t i = 0; i < block->subnet_len; i++) {
+      uint32_t client = index * config->block_size + i;
+      dhcp_lease* lease = block->addresses + i;
+
+      memset(lease->hwaddr, 0, DHCP_HWADDR_LEN);
+      memcpy(lease->hwaddr, &client, sizeof(client));
+      lease->xid = client;
+      _dhcp_lease_set_state(block, i, LEASED, config);
+      dhcp_lease_set_end(lease, 3600, config);
+    }
+  }
+
+  long total = _bench_rss() - before;
+  long packed = block_lease_storage_size(config->block_size) * config->number_of_blocks;
+  long clients = sizeof(ddhcp_client) * config->clients.size;
+
+  before = _bench_rss();
+  struct bench_lease_unpacked** arrays = calloc(config->number_of_blocks, sizeof(struct bench_lease_unpacked*));
+
+  for (uint32_t index = 0; index < config->number_of_blocks; index++) {
+    arrays[index] = calloc(config->block_size, sizeof(struct bench_lease_unpacked));
+
+    for (uint32_t i = 0; i < config->block_size; i++) {
+      arrays[index][i].state = LEASED;
+      arrays[index][i].xid = index * config->block_size + i;
+    }
+  }
+
+  long unpacked = _bench_rss() - before;
+
+  printf("fully leased /16, %u leases in %u blocks, %u client table slots\n", leases, config->number_of_blocks, config->clients.size);
+  printf("            \ttotal KiB\tbytes/lease\tleases KiB\tclients KiB\tother KiB\n");
+  printf("      packed\t%ld\t\t%.1f\t\t%ld\t\t%ld\t\t%ld\n", total / 1024, (double) total / leases,
+         packed / 1024, clients / 1024, (total - packed - clients) / 1024);
+  printf("      unpacked\t%ld\t\t%.1f\t\t%ld\t\t%ld\t\t%ld\n", (total - packed + unpacked) / 1024, (double)(total - packed + unpacked) / leases,
+         unpacked / 1024, clients / 1024, (total - packed - clients) / 1024);
+
+  for (uint32_t index = 0; index < config->number_of_blocks; index++) {
+    free(arrays[index]);
+  }
+
+  free(arrays);
+  test_config_free(config);
+}
+
+/**
+ * Send an UPDATECLAIM for count blocks from indices with timeouts, range
+ * encoded or not, and return the bytes queued on the wire.
+ */
+static int _bench_claim_bytes(uint32_t* indices, uint16_t* timeouts, uint32_t count, int ranges, ddhcp_config* config) {
+  ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_UPDATECLAIM, config);
+  ddhcp_send_queue* queue = &config->mcast_queue;
+  int bytes = 0;
+
+  packet->payload = (ddhcp_payload*) calloc(count, sizeof(ddhcp_payload));
+  packet->count = count;
+
+  for (uint32_t i = 0; i < count; i++) {
+    packet->payload[i].block_index = indices[i];
+    packet->payload[i].timeout = timeouts[i];
+    packet->payload[i].reserved = DDHCP_CLAIM_CAP_RANGES;
+    packet->payload[i].length = 1;
+  }
+
+  if (ranges) {
+    packet_compress_claims(packet);
+  }
+
+  send_packet_mcast_batch(packet, config);
+
+  for (uint32_t i = queue->first; i < queue->count; i++) {
+    bytes += queue->iovecs[i].iov_len;
+  }
+
+  queue->count = queue->first = 0;
+  free(packet->payload);
+  free(packet);
+  return bytes;
+}
+
+/**
+ * Compare the bytes sent for claims of contiguous blocks, of every other
+ * block and of contiguous blocks whose timeouts change every 16 blocks.
+ */
+static void bench_claim_encoding(void) {
+  ddhcp_config* config = test_config(8, 32);
+  uint32_t indices[BENCH_CLAIM_BLOCKS];
+  uint16_t timeouts[BENCH_CLAIM_BLOCKS];
+  const char* sets[] = { "contiguous", "fragmented", "mixed timeouts" };
+
+  printf("claim encoding, bytes for %u blocks\n", BENCH_CLAIM_BLOCKS);
+  printf("      claims\t\tlegacy\tranges\n");
+
+  for (int set = 0; set < 3; set++) {
+    for (uint32_t i = 0; i < BENCH_CLAIM_BLOCKS; i++) {
+      indices[i] = set == 1 ? 2 * i : i;
+      timeouts[i] = set == 2 && (i / 16) % 2 ? 30 : 60;
+    }
+
+    printf("      %-14s\t%i\t%i\n", sets[set],
+           _bench_claim_bytes(indices, timeouts, BENCH_CLAIM_BLOCKS, 0, config),
+           _bench_claim_bytes(indices, timeouts, BENCH_CLAIM_BLOCKS, 1, config));
+  }
+
+  test_config_free(config);
+}
+
+static int _bench_time_cmp(const void* a, const void* b) {
+  time_t time_a = *(const time_t*) a;
+  time_t time_b = *(const time_t*) b;
+  return (time_a > time_b) - (time_a < time_b);
+}
+
+/**
+ * Own BENCH_REFRESH_BLOCKS blocks at random times within one block timeout
+ * and keep them for BENCH_REFRESH_HOURS hours on the synthetic clock. Counts
+ * the UPDATECLAIM messages sent when every block is refreshed as soon as it
+ * is within the update margin of its timeout, as before claim epochs, and
+ * those block_update_claims sends with claim epochs.
+ */
+static void bench_claim_refresh(void) {
+  ddhcp_config* config = test_config(24, 8);
+  time_t owned[BENCH_REFRESH_BLOCKS];
+  time_t timeouts[BENCH_REFRESH_BLOCKS];
+  time_t start = clock_now();
+  time_t end = start + BENCH_REFRESH_HOURS * 3600;
+  int margin = _block_update_margin(config);
+  uint64_t before = 0;
+
+  for (uint32_t i = 0; i < BENCH_REFRESH_BLOCKS; i++) {
+    owned[i] = start + rand() % config->block_timeout;
+    timeouts[i] = 0;
+  }
+
+  // The house keeping woke up for the first block due and refreshed all
+  // blocks within the margin, new blocks right away.
+  for (time_t now = start; now < end; now++) {
+    int refreshed = 0;
+
+    for (uint32_t i = 0; i < BENCH_REFRESH_BLOCKS; i++) {
+      if (owned[i] <= now && timeouts[i] < now + margin) {
+        timeouts[i] = now + config->block_timeout;
+        refreshed = 1;
+      }
+    }
+
+    before += refreshed;
+  }
+
+  // Owned in order of time, block i is the i-th one owned.
+  qsort(owned, BENCH_REFRESH_BLOCKS, sizeof(time_t), _bench_time_cmp);
+
+  for (uint32_t ours = 0; clock_now() < end;) {
+    for (; ours < BENCH_REFRESH_BLOCKS && owned[ours] <= clock_now(); ours++) {
+      block_own(block_materialize(ours, config), config);
+    }
+
+    block_check_timeouts(config);
+    block_update_claims(0, config);
+    config->mcast_queue.count = config->mcast_queue.first = 0;
+
+    time_t next = end;
+    time_t due = timer_wheel_next(&config->timers);
+
+    if (ours < BENCH_REFRESH_BLOCKS && owned[ours] < next) {
+      next = owned[ours];
+    }
+
+    if (due != 0 && due < next) {
+      next = due;
+    }
+
+    if (block_next_update(config) != 0 && block_next_update(config) < next) {
+      next = block_next_update(config);
+    }
+
+    clock_set(next > clock_now() ? next : clock_now() + 1);
+  }
+
+  printf("claim refresh, %u blocks owned within %u seconds, over %u hours\n", BENCH_REFRESH_BLOCKS, config->block_timeout, BENCH_REFRESH_HOURS);
+  printf("      UPDATECLAIM messages per hour\tbefore %.1f\tepochs %.1f\n",
+         (double) before / BENCH_REFRESH_HOURS, (double) config->block_messages.messages / BENCH_REFRESH_HOURS);
+
+  test_config_free(config);
+}
+
+/**
+ * Let nodes claim BENCH_BLOCKS_PER_NODE blocks each of a /14 in blocks of 32
+ * addresses, 90% of which are claimed already. In every round each node
+ * which still needs blocks inquires all of them at once, like block_claim
+ * does, and has heard of all other nodes. Of several nodes inquiring the
+ * same block the first one wins, the others back off. Returns the number of
+ * rounds until all nodes are done and adds the collisions to collisions.
+ */
+static uint32_t _bench_claim_rounds(uint32_t nodes, int shared, uint64_t* collisions) {
+  ddhcp_config* configs[BENCH_MAX_NODES];
+  uint32_t needed[BENCH_MAX_NODES];
+  uint32_t picked[BENCH_MAX_NODES][BENCH_BLOCKS_PER_NODE];
+  uint32_t picked_len[BENCH_MAX_NODES];
+  uint32_t missing = nodes * BENCH_BLOCKS_PER_NODE;
+  uint32_t rounds = 0;
+
+  for (uint32_t n = 0; n < nodes; n++) {
+    configs[n] = test_config(14, 32);
+    needed[n] = BENCH_BLOCKS_PER_NODE;
+
+    for (uint32_t i = 0; i < sizeof(ddhcp_node_id); i++) {
+      configs[n]->node_id[i] = rand();
+    }
+  }
+
+  uint32_t blocks = configs[0]->number_of_blocks;
+
+  for (uint32_t index = 0; index < blocks; index++) {
+    if (rand() % 10 == 0) {
+      continue;
+    }
+
+    for (uint32_t n = 0; n < nodes; n++) {
+      block_set_state(block_materialize(index, configs[n]), DDHCP_CLAIMED, configs[n]);
+    }
+  }
+
+  while (missing > 0 && rounds < blocks) {
+    rounds++;
+    clock_set(TEST_CLOCK_START + rounds);
+
+    for (uint32_t n = 0; n < nodes; n++) {
+      configs[n]->peers_len = 0;
+
+      for (uint32_t other = 0; other < nodes; other++) {
+        if (other != n) {
+          ddhcp_peer* peer = configs[n]->peers + configs[n]->peers_len++;
+          NODE_ID_CP(peer->node_id, configs[other]->node_id);
+          peer->last_seen = clock_now();
+        }
+      }
+    }
+
+    for (uint32_t n = 0; n < nodes; n++) {
+      picked_len[n] = 0;
+
+      // Losers of a collision back off like block_claim does.
+      if (clock_now() < configs[n]->claim_backoff_until) {
+        continue;
+      }
+
+      while (picked_len[n] < needed[n] && configs[n]->num_free_blocks > 0) {
+        uint32_t index;
+
+        if (shared) {
+          index = block_find_free(configs[n])->index;
+        } else {
+          index = _block_index_select_free(rand() % configs[n]->num_free_blocks, configs[n]);
+        }
+
+        block_set_state(block_materialize(index, configs[n]), DDHCP_CLAIMING, configs[n]);
+        picked[n][picked_len[n]++] = index;
+      }
+    }
+
+    for (uint32_t n = 0; n < nodes; n++) {
+      for (uint32_t i = 0; i < picked_len[n]; i++) {
+        uint32_t winner = n;
+
+        for (uint32_t other = 0; other < n && winner == n; other++) {
+          for (uint32_t j = 0; j < picked_len[other]; j++) {
+            if (picked[other][j] == picked[n][i]) {
+              winner = other;
+              break;
+            }
+          }
+        }
+
+        if (winner != n) {
+          (*collisions)++;
+          block_claim_collision(block_lookup(picked[n][i], configs[n]), configs[n]);
+          continue;
+        }
+
+        needed[n]--;
+        missing--;
+        configs[n]->claim_backoff = 0;
+
+        for (uint32_t other = 0; other < nodes; other++) {
+          block_set_state(block_materialize(picked[n][i], configs[other]), DDHCP_CLAIMED, configs[other]);
+        }
+      }
+    }
+  }
+
+  for (uint32_t n = 0; n < nodes; n++) {
+    test_config_free(configs[n]);
+  }
+
+  return rounds;
+}
+
+/**
+ * Compare the rounds and collisions until nodes claimed their blocks at 90%
+ * utilisation, picking from the share of free blocks of every node and
+ * picking uniformly at random.
+ */
+static void bench_claim_convergence(void) {
+  uint32_t node_counts[] = { 2, 4, 8, 16, 32, 64 };
+
+  printf("claim convergence, %u blocks per node, 90%% of the blocks claimed, %u trials\n", BENCH_BLOCKS_PER_NODE, BENCH_TRIALS);
+  printf("      nodes\tshared rounds/collisions\trandom rounds/collisions\n");
+
+  for (size_t i = 0; i < sizeof(node_counts) / sizeof(node_counts[0]); i++) {
+    uint64_t rounds[2] = { 0 };
+    uint64_t collisions[2] = { 0 };
+
+    for (int trial = 0; trial < BENCH_TRIALS; trial++) {
+      for (int shared = 0; shared < 2; shared++) {
+        rounds[shared] += _bench_claim_rounds(node_counts[i], shared, collisions + shared);
+      }
+    }
+
+    printf("      %u\t%.1f/%.1f\t%.1f/%.1f\n", node_counts[i],
+           (double) rounds[1] / BENCH_TRIALS, (double) collisions[1] / BENCH_TRIALS,
+           (double) rounds[0] / BENCH_TRIALS, (double) collisions[0] / BENCH_TRIALS);
+  }
+}
+
+int main(int argc, char** argv) {
+  (void) argc;
+  (void) argv;
+
+  bench_lease_memory();
+  bench_scan_layout();
+  bench_claim_encoding();
+  bench_claim_refresh();
+  bench_claim_convergence();
+  return 0;
+}
@@ -0,0 +1,51 @@
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+#include "batch.h"
+#include "clock.h"
+#include "ddhcp.h"
+#include "dhcp_options.h"
+
+ddhcp_config* test_config(uint8_t prefix_len, uint32_t block_size) {
+  ddhcp_config* config = (ddhcp_config*) calloc(sizeof(ddhcp_config), 1);
+
+  if (config == NULL) {
+    abort();
+  }
+
+  inet_aton("10.0.0.0", &config->prefix);
+  config->prefix_len = prefix_len;
+  config->block_size = block_size;
+  config->number_of_blocks = ((uint64_t) 1 << (32 - prefix_len)) / block_size;
+  config->spare_blocks_needed = 1;
+  config->block_timeout = 60;
+  config->block_refresh_factor = 4;
+  config->tentative_timeout = 15;
+  config->claim_interval = 1;
+  config->dhcp_port = 67;
+  config->mcast_mtu = 1500;
+  config->mcast_socket = config->server_socket = config->client_socket = -1;
+  init_option_store(&config->options);
+  clock_set(TEST_CLOCK_START);
+  INIT_LIST_HEAD(&config->dhcp_packet_cache.list);
+
+  if (ddhcp_block_init(config)
+      || batch_queue_init(&config->mcast_queue, -1)
+      || batch_queue_init(&config->server_queue, -1)
+      || batch_queue_init(&config->client_queue, -1)) {
+    abort();
+  }
+
+  return config;
+}
+
+void test_config_free(ddhcp_config* config) {
+  ddhcp_block_free(config);
+  batch_queue_free(&config->mcast_queue);
+  batch_queue_free(&config->server_queue);
+  batch_queue_free(&config->client_queue);
+  free_option_store(&config->options);
+  free(config);
+}
@@ -0,0 +1,54 @@
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct test_suite {
+  const char* name;
+  void (*run)(void);
+};
+
+static struct test_suite suites[] = {
+  { "block index", test_block_index },
+  { "block table", test_block_table },
+  { "block find free", test_block_find_free },
+  { "scan kernels", test_scan },
+  { "dhcp client table", test_dhcp_client_table },
+  { "dhcp clients", test_dhcp_clients },
+  { "dhcp relays", test_dhcp_relays },
+  { "claim ranges", test_packet_claims },
+  { "claims received", test_packet_claims_received },
+  { "timer wheel", test_timer_wheel },
+  { "timeouts", test_timeouts },
+  { "claim epochs", test_claim_epochs },
+};
+
+static uint32_t checks = 0;
+static uint32_t failures = 0;
+
+int test_check(int ok, const char* expr, const char* file, int line) {
+  checks++;
+
+  if (!ok) {
+    failures++;
+    fprintf(stderr, "%s:%i: check failed: %s\n", file, line, expr);
+  }
+
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  (void) argc;
+  (void) argv;
+
+  srand(1);
+
+  for (size_t i = 0; i < sizeof(suites) / sizeof(suites[0]); i++) {
+    uint32_t failed = failures;
+    suites[i].run();
+    printf("%-24s%s\n", suites[i].name, failures == failed ? "ok" : "FAILED");
+  }
+
+  printf("%u checks, %u failed\n", checks, failures);
+  return failures > 0;
+}
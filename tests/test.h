@@ -0,0 +1,49 @@
+#ifndef _TEST_H
+#define _TEST_H
+
+#include "types.h"
+
+/**
+ * A minimal harness for the unit tests run by make check and the
+ * benchmarks run by make bench.
+ *
+ * Every suite is a function registered in test.c, checks report failures
+ * with file and line and do not abort the suite.
+ */
+
+/**
+ * Record the result of a check, returns the result.
+ */
+int test_check(int ok, const char* expr, const char* file, int line);
+
+#define CHECK(cond) test_check(!!(cond), #cond, __FILE__, __LINE__)
+
+// The synthetic clock of a new configuration starts here.
+#define TEST_CLOCK_START 1000000
+
+/**
+ * Create a configuration managing 10.0.0.0/prefix_len in blocks of
+ * block_size addresses, with initialized block structures and send queues
+ * not bound to any socket.
+ */
+ddhcp_config* test_config(uint8_t prefix_len, uint32_t block_size);
+
+/**
+ * Free a configuration created by test_config.
+ */
+void test_config_free(ddhcp_config* config);
+
+void test_block_index(void);
+void test_block_table(void);
+void test_block_find_free(void);
+void test_scan(void);
+void test_dhcp_client_table(void);
+void test_dhcp_clients(void);
+void test_dhcp_relays(void);
+void test_packet_claims(void);
+void test_packet_claims_received(void);
+void test_timer_wheel(void);
+void test_timeouts(void);
+void test_claim_epochs(void);
+
+#endif
@@ -0,0 +1,237 @@
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+#include "block.h"
+#include "clock.h"
+#include "peer.h"
+
+// Internals of block.c
+void _block_index_mark(uint32_t index, int used, ddhcp_config* config);
+uint32_t _block_index_select_free(uint32_t k, ddhcp_config* config);
+
+/**
+ * Compare the free block index with the used flags of every block.
+ */
+static void _test_block_index_compare(uint8_t* used, ddhcp_config* config) {
+  uint32_t k = 0;
+
+  for (uint32_t index = 0; index < config->number_of_blocks; index++) {
+    if (used[index]) {
+      continue;
+    }
+
+    if (!CHECK(_block_index_select_free(k, config) == index)) {
+      fprintf(stderr, "  %u blocks: free block %u is not block %u\n", config->number_of_blocks, k, index);
+      return;
+    }
+
+    k++;
+  }
+
+  CHECK(config->num_free_blocks == k);
+}
+
+void test_block_index(void) {
+  uint8_t sizes[] = { 31, 30, 29, 26, 22, 20 };
+
+  for (size_t i = 0; i < sizeof(sizes); i++) {
+    // Blocks of two addresses, from 1 to 2048 blocks.
+    ddhcp_config* config = test_config(sizes[i], 2);
+    uint32_t blocks = config->number_of_blocks;
+    uint8_t* used = (uint8_t*) calloc(blocks, 1);
+
+    _test_block_index_compare(used, config);
+
+    // Marking a block twice must not change the count.
+    for (uint32_t round = 0; round < 4 * blocks; round++) {
+      uint32_t index = rand() % blocks;
+      used[index] = rand() % 2;
+      _block_index_mark(index, used[index], config);
+    }
+
+    _test_block_index_compare(used, config);
+
+    for (uint32_t index = 0; index < blocks; index++) {
+      used[index] = 1;
+      _block_index_mark(index, 1, config);
+    }
+
+    CHECK(config->num_free_blocks == 0);
+
+    // Free only the very first and very last block.
+    used[0] = used[blocks - 1] = 0;
+    _block_index_mark(0, 0, config);
+    _block_index_mark(blocks - 1, 0, config);
+    _test_block_index_compare(used, config);
+
+    free(used);
+    test_config_free(config);
+  }
+}
+
+void test_block_table(void) {
+  // 128 blocks in two pages.
+  ddhcp_config* config = test_config(25, 1);
+
+  CHECK(block_lookup(70, config) == NULL);
+  CHECK(block_state(70, config) == DDHCP_FREE);
+
+  ddhcp_block* block = block_materialize(70, config);
+  CHECK(block != NULL && block->index == 70);
+  CHECK(block_lookup(70, config) == block);
+  CHECK(block_lookup(127, config) != NULL && block_lookup(127, config)->index == 127);
+  CHECK(block_lookup(10, config) == NULL);
+  CHECK(ntohl(block->subnet.s_addr) - ntohl(config->prefix.s_addr) == 70 * config->block_size);
+
+  // A page of FREE blocks is idle and released.
+  block_table_reclaim(config);
+  CHECK(block_lookup(70, config) == NULL);
+
+  block = block_materialize(70, config);
+  block_set_state(block, DDHCP_CLAIMED, config);
+  block_set_timeout(block, 100, config);
+  CHECK(config->num_blocks[DDHCP_CLAIMED] == 1);
+  CHECK(config->num_free_blocks == 127);
+
+  block_table_reclaim(config);
+  CHECK(block_lookup(70, config) == block);
+  CHECK(block_state(70, config) == DDHCP_CLAIMED);
+  CHECK(BLOCK_TIMEOUT(block) == 100);
+
+  // Other blocks of the page may change their state meanwhile.
+  ddhcp_block* other = block_materialize(64, config);
+  block_set_state(other, DDHCP_TENTATIVE, config);
+  block_free(block, config);
+  block_table_reclaim(config);
+  CHECK(block_lookup(70, config) != NULL);
+  CHECK(block_state(70, config) == DDHCP_FREE);
+  CHECK(config->num_blocks[DDHCP_CLAIMED] == 0);
+
+  block_free(other, config);
+  block_table_reclaim(config);
+  CHECK(block_lookup(64, config) == NULL);
+  CHECK(config->num_free_blocks == 128);
+  CHECK(config->num_blocks[DDHCP_TENTATIVE] == 0);
+
+  // Materialized again, the page starts over with FREE blocks.
+  block = block_materialize(71, config);
+  CHECK(block_state(71, config) == DDHCP_FREE);
+  CHECK(block_state(70, config) == DDHCP_FREE);
+  CHECK(block->addresses == NULL);
+
+  test_config_free(config);
+
+  // 32 blocks, the only page is truncated.
+  config = test_config(27, 1);
+  block = block_materialize(31, config);
+  block_set_state(block, DDHCP_TENTATIVE, config);
+  CHECK(block_lookup(0, config) != NULL && block_lookup(0, config)->index == 0);
+  block_free(block, config);
+  block_table_reclaim(config);
+  CHECK(block_lookup(31, config) == NULL);
+  CHECK(config->num_free_blocks == 32);
+
+  test_config_free(config);
+}
+
+/**
+ * Set the state of the blocks from first up to last.
+ */
+static void _test_block_set_states(uint32_t first, uint32_t last, enum ddhcp_block_state state, ddhcp_config* config) {
+  for (uint32_t index = first; index < last; index++) {
+    ddhcp_block* block = block_materialize(index, config);
+
+    if (state == DDHCP_FREE) {
+      block_free(block, config);
+    } else {
+      block_set_state(block, state, config);
+    }
+  }
+}
+
+/**
+ * Make us know of below nodes with a smaller and above nodes with a larger
+ * node id than ours, all just heard of.
+ */
+static void _test_block_peers(uint32_t below, uint32_t above, ddhcp_config* config) {
+  config->peers_len = 0;
+
+  for (uint32_t i = 0; i < below + above; i++) {
+    ddhcp_peer* peer = config->peers + config->peers_len++;
+    NODE_ID_CP(peer->node_id, config->node_id);
+    peer->node_id[0] = i < below ? 0x00 : 0xFF;
+    peer->node_id[1] = i;
+    peer->last_seen = clock_now();
+  }
+}
+
+void test_block_find_free(void) {
+  // 32 blocks of 8 addresses.
+  ddhcp_config* config = test_config(24, 8);
+  uint32_t blocks = config->number_of_blocks;
+  uint32_t nodes;
+
+  config->node_id[0] = 0x80;
+
+  // Alone we may pick any free block.
+  CHECK(peer_rank(config, &nodes) == 0 && nodes == 1);
+  CHECK(block_find_free(config) != NULL);
+
+  // With a node per block, our share is the one block at our rank.
+  _test_block_peers(10, blocks - 11, config);
+  CHECK(peer_rank(config, &nodes) == 10 && nodes == blocks);
+  CHECK(block_find_free(config)->index == 10);
+
+  // Shares are taken from the free blocks only.
+  _test_block_set_states(0, 16, DDHCP_CLAIMED, config);
+  _test_block_peers(10, 5, config);
+  CHECK(block_find_free(config)->index == 26);
+  _test_block_set_states(0, 16, DDHCP_FREE, config);
+
+  // Blocks we are claiming count into our share of two blocks.
+  ddhcp_block* block = block_find_free(config);
+  CHECK(block->index == 20 || block->index == 21);
+  block_set_state(block, DDHCP_CLAIMING, config);
+  CHECK(block_find_free(config)->index == (block->index == 20 ? 21 : 20));
+  _test_block_set_states(20, 22, DDHCP_FREE, config);
+  _test_block_peers(10, blocks - 11, config);
+
+  // Our own claims looped back to us do not count.
+  NODE_ID_CP(config->peers[config->peers_len++].node_id, config->node_id);
+  config->peers[config->peers_len - 1].last_seen = clock_now();
+  CHECK(peer_rank(config, &nodes) == 10 && nodes == blocks);
+  CHECK(block_find_free(config)->index == 10);
+
+  // A contested block is skipped while it is listed.
+  block_claim_collision(block_lookup(10, config), config);
+  block_claim_collision(block_lookup(11, config), config);
+  CHECK(block_find_free(config)->index == 12);
+  CHECK(config->contested_skips == 2);
+
+  clock_set(clock_now() + config->block_timeout - 1);
+  _test_block_peers(10, blocks - 11, config);
+  CHECK(block_find_free(config)->index == 12);
+
+  clock_set(clock_now() + 1);
+  _test_block_peers(10, blocks - 11, config);
+  CHECK(block_find_free(config)->index == 10);
+  CHECK(config->contested_skips == 4);
+
+  // Past the last block the search wraps to the first one.
+  _test_block_peers(blocks - 1, 0, config);
+  block_claim_collision(block_lookup(blocks - 1, config), config);
+  CHECK(block_find_free(config)->index == 0);
+
+  // Contested blocks are still taken if nothing else is free.
+  _test_block_set_states(0, blocks - 1, DDHCP_CLAIMED, config);
+  CHECK(config->num_free_blocks == 1);
+  CHECK(block_find_free(config)->index == blocks - 1);
+
+  // Silent nodes are forgotten, the share spans all free blocks again.
+  clock_set(clock_now() + config->block_timeout + 1);
+  CHECK(peer_rank(config, &nodes) == 0 && nodes == 1);
+
+  test_config_free(config);
+}
@@ -0,0 +1,200 @@
+#include "test.h"
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "block.h"
+#include "client.h"
+#include "dhcp.h"
+#include "dhcp_packet.h"
+
+// Internals of dhcp.c
+void _dhcp_lease_set_state(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, ddhcp_config* config);
+
+/**
+ * Write a request of msg_type into buffer and return its length.
+ */
+static int _test_dhcp_request(uint8_t* buffer, uint8_t msg_type, uint8_t htype, uint8_t hlen, const char* giaddr) {
+  uint32_t xid = htonl(42);
+  uint16_t flags = htons(0x8000);
+  uint8_t options[] = { 99, 130, 83, 99, DHCP_CODE_MESSAGE_TYPE, 1, msg_type, DHCP_CODE_END };
+  struct in_addr relay = { INADDR_ANY };
+
+  if (giaddr) {
+    inet_aton(giaddr, &relay);
+  }
+
+  // Fixed BOOTP header asking for broadcast replies, followed by the magic
+  // cookie and options.
+  memset(buffer, 0, 236);
+  buffer[0] = 1;
+  buffer[1] = htype;
+  buffer[2] = hlen;
+  memcpy(buffer + 4, &xid, 4);
+  memcpy(buffer + 10, &flags, 2);
+  memcpy(buffer + 24, &relay, 4);
+  memset(buffer + 28, 0xAB, hlen < 16 ? hlen : 16);
+  memcpy(buffer + 236, options, sizeof(options));
+
+  return 236 + sizeof(options);
+}
+
+void test_dhcp_client_table(void) {
+  ddhcp_config* config = test_config(24, 32);
+  ddhcp_block* block = block_materialize(0, config);
+  uint8_t buffer[300];
+  uint8_t hwaddr[16];
+  int len;
+
+  memset(hwaddr, 0xAB, sizeof(hwaddr));
+  block_own(block, config);
+
+  len = _test_dhcp_request(buffer, DHCPDISCOVER, ARPHRD_ETHER, ETH_ALEN, NULL);
+  dhcp_process(buffer, len, config);
+  CHECK(config->num_leases[OFFERED] == 1);
+
+  ddhcp_client* client = client_table_find(&config->clients, hwaddr);
+
+  if (!CHECK(client != NULL)) {
+    test_config_free(config);
+    return;
+  }
+
+  uint32_t offset = client->offset;
+  CHECK(block->lease_states[offset] == OFFERED);
+
+  // Offers in blocks we no longer own are not acked.
+  len = _test_dhcp_request(buffer, DHCPREQUEST, ARPHRD_ETHER, ETH_ALEN, NULL);
+  block_set_state(block, DDHCP_CLAIMED, config);
+  dhcp_process(buffer, len, config);
+  CHECK(block->lease_states[offset] == OFFERED);
+
+  // Clients which could not be indexed are found by a scan of our offers.
+  block_set_state(block, DDHCP_OURS, config);
+  client_table_del(&config->clients, hwaddr, offset);
+  config->clients.unindexed = 1;
+  CHECK(client_table_find(&config->clients, hwaddr) == NULL);
+
+  dhcp_process(buffer, len, config);
+  CHECK(block->lease_states[offset] == LEASED);
+  CHECK(config->num_leases[LEASED] == 1);
+
+  // And indexed again on the next rebuild.
+  client_table_del(&config->clients, hwaddr, offset);
+  dhcp_client_table_rebuild(config);
+  CHECK(config->clients.unindexed == 0);
+  client = client_table_find(&config->clients, hwaddr);
+  CHECK(client != NULL && client->offset == offset);
+
+  test_config_free(config);
+}
+
+void test_dhcp_clients(void) {
+  ddhcp_config* config = test_config(24, 32);
+  uint8_t buffer[300];
+  int len;
+
+  block_own(block_materialize(0, config), config);
+
+  len = _test_dhcp_request(buffer, DHCPDISCOVER, 6, ETH_ALEN, NULL);
+  dhcp_process(buffer, len, config);
+  CHECK(config->non_ethernet_requests == 1);
+  CHECK(config->num_leases[OFFERED] == 0);
+
+  // Only the first 6 bytes of chaddr are recorded.
+  len = _test_dhcp_request(buffer, DHCPDISCOVER, ARPHRD_ETHER, 16, NULL);
+  dhcp_process(buffer, len, config);
+  CHECK(config->non_ethernet_requests == 2);
+  CHECK(config->num_leases[OFFERED] == 0);
+
+  len = _test_dhcp_request(buffer, DHCPDISCOVER, ARPHRD_ETHER, ETH_ALEN, NULL);
+  dhcp_process(buffer, len, config);
+  CHECK(config->non_ethernet_requests == 2);
+  CHECK(config->num_leases[OFFERED] == 1);
+
+  test_config_free(config);
+}
+
+/**
+ * Send a DISCOVER through the relay agent at giaddr, return the block
+ * of the address offered or -1 if none was.
+ */
+static int _test_dhcp_relayed_discover(const char* giaddr, ddhcp_config* config) {
+  uint8_t buffer[300];
+  uint32_t offered = config->num_leases[OFFERED];
+  int len = _test_dhcp_request(buffer, DHCPDISCOVER, ARPHRD_ETHER, ETH_ALEN, giaddr);
+
+  dhcp_process(buffer, len, config);
+
+  if (config->num_leases[OFFERED] == offered) {
+    return -1;
+  }
+
+  ddhcp_block* block;
+
+  list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+    for (uint32_t i = 0; i < block->subnet_len; i++) {
+      if (block->lease_states[i] == OFFERED && block->addresses[i].xid == 42) {
+        // Offer the next client another address.
+        block->addresses[i].xid = 0;
+        return (int) block->index;
+      }
+    }
+  }
+
+  return -1;
+}
+
+void test_dhcp_relays(void) {
+  // Eight blocks of 32 addresses in 10.0.0.0/24.
+  ddhcp_config* config = test_config(24, 32);
+
+  block_own(block_materialize(1, config), config);
+  block_own(block_materialize(5, config), config);
+
+  // Relay agents outside of our prefix are counted, but not tracked.
+  for (int i = 0; i < 2 * DHCP_RELAYS; i++) {
+    char giaddr[16];
+    snprintf(giaddr, sizeof(giaddr), "10.0.1.%i", i + 1);
+    CHECK(_test_dhcp_relayed_discover(giaddr, config) == -1);
+  }
+
+  CHECK(config->relay_rejected == 2 * DHCP_RELAYS);
+  CHECK(config->relays_len == 0);
+  CHECK(config->client_queue.count == 0);
+
+  // The pool of the segment of the relay agent, or the closest one.
+  CHECK(_test_dhcp_relayed_discover("10.0.0.161", config) == 5);
+  CHECK(_test_dhcp_relayed_discover("10.0.0.65", config) == 1);
+  CHECK(_test_dhcp_relayed_discover("10.0.0.129", config) == 5);
+  CHECK(_test_dhcp_relayed_discover("10.0.0.1", config) == 1);
+  CHECK(config->relays_len == 4);
+  CHECK(config->client_queue.count == 4);
+
+  dhcp_relay* relay = config->relays;
+  CHECK(relay->address.s_addr == htonl(0x0A0000A1));
+  CHECK(relay->requests == 1 && relay->replies == 1);
+
+  // Block 5 is full, the relay agent of its segment gets block 1.
+  for (uint32_t i = 0; i < block_lookup(5, config)->subnet_len; i++) {
+    _dhcp_lease_set_state(block_lookup(5, config), i, LEASED, config);
+  }
+
+  CHECK(_test_dhcp_relayed_discover("10.0.0.161", config) == 1);
+  CHECK(relay->requests == 2 && relay->replies == 2);
+  CHECK(config->relays_len == 4);
+
+  // Without free leases there is no offer.
+  for (uint32_t i = 0; i < block_lookup(1, config)->subnet_len; i++) {
+    _dhcp_lease_set_state(block_lookup(1, config), i, LEASED, config);
+  }
+
+  CHECK(_test_dhcp_relayed_discover("10.0.0.161", config) == -1);
+  CHECK(config->client_queue.count == 5);
+  CHECK(relay->requests == 3 && relay->replies == 2);
+
+  test_config_free(config);
+}
@@ -0,0 +1,198 @@
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "ddhcp.h"
+#include "packet.h"
+
+// Internals of packet.c
+int _packet_size(int command, int payload_count);
+
+/**
+ * Build an UPDATECLAIM packet claiming count blocks from indices.
+ */
+static ddhcp_mcast_packet* _test_packet_claims(uint32_t* indices, uint16_t* timeouts, uint32_t count, ddhcp_config* config) {
+  ddhcp_mcast_packet* packet = new_ddhcp_packet(DDHCP_MSG_UPDATECLAIM, config);
+  packet->payload = (ddhcp_payload*) calloc(count > 0 ? count : 1, sizeof(ddhcp_payload));
+  packet->count = count;
+
+  for (uint32_t i = 0; i < count; i++) {
+    packet->payload[i].block_index = indices[i];
+    packet->payload[i].timeout = timeouts ? timeouts[i] : 60;
+    packet->payload[i].reserved = DDHCP_CLAIM_CAP_RANGES;
+    packet->payload[i].length = 1;
+  }
+
+  return packet;
+}
+
+static void _test_packet_free(ddhcp_mcast_packet* packet) {
+  free(packet->payload);
+  free(packet);
+}
+
+static int _test_packet_range(ddhcp_payload* range, uint32_t block_index, uint16_t length, uint16_t timeout) {
+  return range->block_index == block_index && range->length == length && range->timeout == timeout;
+}
+
+/**
+ * Send packet and parse the datagrams queued for it back. Returns the
+ * number of bytes sent and the blocks claimed in all datagrams in blocks,
+ * 0 if a datagram claims more than DDHCP_CLAIM_MAX_BLOCKS.
+ */
+static int _test_packet_send(ddhcp_mcast_packet* packet, uint32_t* blocks, ddhcp_config* config) {
+  ddhcp_send_queue* queue = &config->mcast_queue;
+  uint32_t first = queue->count;
+  int bytes = 0;
+
+  send_packet_mcast_batch(packet, config);
+  *blocks = 0;
+
+  for (uint32_t i = first; i < queue->count; i++) {
+    ddhcp_mcast_packet received;
+    uint32_t claimed = 0;
+
+    if (!CHECK(ntoh_mcast_packet(queue->iovecs[i].iov_base, queue->iovecs[i].iov_len, &received) == 0)) {
+      return 0;
+    }
+
+    for (uint32_t j = 0; j < received.count; j++) {
+      claimed += received.payload[j].length;
+    }
+
+    free(received.payload);
+
+    if (!CHECK(claimed <= DDHCP_CLAIM_MAX_BLOCKS)) {
+      return 0;
+    }
+
+    *blocks += claimed;
+    bytes += queue->iovecs[i].iov_len;
+  }
+
+  queue->count = queue->first = 0;
+  return bytes;
+}
+
+void test_packet_claims(void) {
+  ddhcp_config* config = test_config(16, 32);
+
+  // Runs, gaps, a duplicate and a differing timeout, out of order.
+  uint32_t indices[] = { 7, 5, 10, 6, 3, 7, 9 };
+  uint16_t timeouts[] = { 60, 60, 30, 60, 60, 60, 60 };
+  ddhcp_mcast_packet* packet = _test_packet_claims(indices, timeouts, 7, config);
+
+  packet_compress_claims(packet);
+  CHECK(packet->command == DDHCP_MSG_UPDATECLAIM_RANGES);
+  CHECK(packet->count == 4);
+  CHECK(_test_packet_range(packet->payload + 0, 3, 1, 60));
+  CHECK(_test_packet_range(packet->payload + 1, 5, 3, 60));
+  CHECK(_test_packet_range(packet->payload + 2, 9, 1, 60));
+  CHECK(_test_packet_range(packet->payload + 3, 10, 1, 30));
+  _test_packet_free(packet);
+
+  packet = _test_packet_claims(NULL, NULL, 0, config);
+  packet_compress_claims(packet);
+  CHECK(packet->command == DDHCP_MSG_UPDATECLAIM_RANGES && packet->count == 0);
+  _test_packet_free(packet);
+
+  // Long runs are split at the claim limit.
+  uint32_t blocks = 2 * DDHCP_CLAIM_MAX_BLOCKS + 90;
+  uint32_t* run = (uint32_t*) calloc(blocks, sizeof(uint32_t));
+
+  for (uint32_t i = 0; i < blocks; i++) {
+    run[i] = i + 100;
+  }
+
+  packet = _test_packet_claims(run, NULL, blocks, config);
+  packet_compress_claims(packet);
+  CHECK(packet->count == 3);
+  CHECK(_test_packet_range(packet->payload + 0, 100, DDHCP_CLAIM_MAX_BLOCKS, 60));
+  CHECK(_test_packet_range(packet->payload + 1, 100 + DDHCP_CLAIM_MAX_BLOCKS, DDHCP_CLAIM_MAX_BLOCKS, 60));
+  CHECK(_test_packet_range(packet->payload + 2, 100 + 2 * DDHCP_CLAIM_MAX_BLOCKS, 90, 60));
+  _test_packet_free(packet);
+
+  // On the wire ranges are smaller, no datagram claims too many blocks.
+  uint32_t claimed;
+  packet = _test_packet_claims(run, NULL, blocks, config);
+  int plain = _test_packet_send(packet, &claimed, config);
+  CHECK(claimed == blocks);
+  CHECK(plain == (int) blocks * 7 + DDHCP_HEADER_LEN * (int) config->block_messages.datagrams);
+
+  packet_compress_claims(packet);
+  int ranges = _test_packet_send(packet, &claimed, config);
+  CHECK(claimed == blocks);
+  CHECK(ranges == 3 * _packet_size(DDHCP_MSG_UPDATECLAIM_RANGES, 1));
+  CHECK(ranges < plain / 50);
+  _test_packet_free(packet);
+
+  // Every other block, nothing to merge, the claims stay as they are.
+  for (uint32_t i = 0; i < blocks; i++) {
+    run[i] = 2 * i;
+  }
+
+  packet = _test_packet_claims(run, NULL, blocks, config);
+  plain = _test_packet_send(packet, &claimed, config);
+  packet_compress_claims(packet);
+  CHECK(packet->command == DDHCP_MSG_UPDATECLAIM);
+  CHECK(packet->count == blocks);
+  ranges = _test_packet_send(packet, &claimed, config);
+  CHECK(claimed == blocks);
+  CHECK(ranges == plain);
+  _test_packet_free(packet);
+
+  free(run);
+  test_config_free(config);
+}
+
+void test_packet_claims_received(void) {
+  ddhcp_config* config = test_config(16, 32);
+  struct sockaddr_in6 sender;
+  ddhcp_node_id node_id = { 1, 2, 3, 4, 5, 6, 7, 8 };
+  uint32_t free_blocks = config->num_free_blocks;
+  uint32_t start = 0;
+
+  memset(&sender, 0, sizeof(sender));
+
+  block_own(block_materialize(3, config), config);
+
+  // A single range claiming the whole prefix is dropped.
+  ddhcp_mcast_packet* packet = _test_packet_claims(&start, NULL, 1, config);
+  memcpy(packet->node_id, node_id, sizeof(ddhcp_node_id));
+  packet->command = DDHCP_MSG_UPDATECLAIM_RANGES;
+  packet->payload[0].length = UINT16_MAX;
+  packet->sender = &sender;
+
+  ddhcp_block_process_claims(packet, config);
+  CHECK(config->block_messages.oversized == 1);
+  CHECK(config->num_free_blocks == free_blocks - 1);
+  CHECK(block_lookup(config->number_of_blocks - 1, config) == NULL);
+  CHECK(block_state(3, config) == DDHCP_OURS);
+
+  // So are ranges which add up to too many blocks.
+  packet->payload = (ddhcp_payload*) realloc(packet->payload, 2 * sizeof(ddhcp_payload));
+  packet->count = 2;
+  packet->payload[0].length = DDHCP_CLAIM_MAX_BLOCKS;
+  packet->payload[1] = packet->payload[0];
+  packet->payload[1].block_index = 1000;
+  packet->payload[1].length = 1;
+
+  ddhcp_block_process_claims(packet, config);
+  CHECK(config->block_messages.oversized == 2);
+  CHECK(config->num_free_blocks == free_blocks - 1);
+
+  // A claim up to the limit is taken.
+  packet->payload[0].length = DDHCP_CLAIM_MAX_BLOCKS - 1;
+
+  ddhcp_block_process_claims(packet, config);
+  CHECK(config->block_messages.oversized == 2);
+  CHECK(config->num_blocks[DDHCP_CLAIMED] == DDHCP_CLAIM_MAX_BLOCKS - 1);
+  CHECK(block_state(3, config) == DDHCP_OURS);
+  CHECK(block_state(1000, config) == DDHCP_CLAIMED);
+  CHECK(block_state(DDHCP_CLAIM_MAX_BLOCKS, config) == DDHCP_FREE);
+
+  _test_packet_free(packet);
+  test_config_free(config);
+}
@@ -0,0 +1,140 @@
+#include "test.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+
+// Internals of scan.c
+extern uint32_t (*_scan_find)(const uint8_t*, uint32_t, uint8_t, int);
+extern uint32_t (*_scan_count)(const uint8_t*, uint32_t, uint8_t);
+uint32_t _scan_find_word(const uint8_t* bytes, uint32_t len, uint8_t value, int other);
+uint32_t _scan_count_word(const uint8_t* bytes, uint32_t len, uint8_t value);
+void _scan_select(void);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t _scan_find_sse2(const uint8_t* bytes, uint32_t len, uint8_t value, int other);
+uint32_t _scan_count_sse2(const uint8_t* bytes, uint32_t len, uint8_t value);
+uint32_t _scan_find_avx2(const uint8_t* bytes, uint32_t len, uint8_t value, int other);
+uint32_t _scan_count_avx2(const uint8_t* bytes, uint32_t len, uint8_t value);
+#endif
+
+#define SCAN_MAX_LEN 130
+#define SCAN_MAX_OFFSET 32
+#define SCAN_BUFFER_LEN 256
+
+// Bytes next to value which trip up a wrong borrow in the word kernel.
+static const uint8_t values[] = { 0x00, 0x01, 0x7F, 0x80, 0xFE, 0xFF };
+
+static uint32_t _reference_find(const uint8_t* bytes, uint32_t len, uint8_t value, int other) {
+  for (uint32_t i = 0; i < len; i++) {
+    if ((bytes[i] == value) != other) {
+      return i;
+    }
+  }
+
+  return len;
+}
+
+static uint32_t _reference_count(const uint8_t* bytes, uint32_t len, uint8_t value) {
+  uint32_t num = 0;
+
+  for (uint32_t i = 0; i < len; i++) {
+    num += bytes[i] == value;
+  }
+
+  return num;
+}
+
+/**
+ * Compare the kernels with the reference on bytes, returns 0 on a mismatch.
+ */
+static int _test_scan_compare(const char* kernel, const uint8_t* bytes, uint32_t len, uint32_t offset, uint8_t value) {
+  if (CHECK(scan_find(bytes, len, value) == _reference_find(bytes, len, value, 0))
+      && CHECK(scan_find_other(bytes, len, value) == _reference_find(bytes, len, value, 1))
+      && CHECK(scan_count(bytes, len, value) == _reference_count(bytes, len, value))) {
+    return 1;
+  }
+
+  fprintf(stderr, "  %s kernel, length %u, offset %u, value 0x%02x\n", kernel, len, offset, value);
+  return 0;
+}
+
+/**
+ * Check len bytes at offset of buffer, random ones and those with a single
+ * byte equal to value or a single other byte at every position.
+ * Bytes behind the range equal value, reading past its end shows.
+ */
+static int _test_scan_case(const char* kernel, uint8_t* buffer, uint32_t offset, uint32_t len, uint8_t value) {
+  uint8_t* bytes = buffer + offset;
+  memset(buffer, value, SCAN_BUFFER_LEN);
+
+  for (uint32_t i = 0; i < len; i++) {
+    bytes[i] = values[rand() % sizeof(values)];
+  }
+
+  if (!_test_scan_compare(kernel, bytes, len, offset, value)) {
+    return 0;
+  }
+
+  for (uint32_t pos = 0; pos < len; pos++) {
+    memset(bytes, value ^ 0x80, len);
+    bytes[pos] = value;
+
+    if (!_test_scan_compare(kernel, bytes, len, offset, value)) {
+      return 0;
+    }
+
+    memset(bytes, value, len);
+    bytes[pos] = value ^ 0x01;
+
+    if (!_test_scan_compare(kernel, bytes, len, offset, value)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+static void _test_scan_kernel(const char* kernel) {
+  uint8_t* buffer = (uint8_t*) aligned_alloc(64, SCAN_BUFFER_LEN);
+  int ok = 1;
+
+  for (size_t v = 0; ok && v < sizeof(values); v++) {
+    for (uint32_t offset = 0; ok && offset < SCAN_MAX_OFFSET; offset++) {
+      for (uint32_t len = 0; ok && len <= SCAN_MAX_LEN; len++) {
+        ok = _test_scan_case(kernel, buffer, offset, len, values[v]);
+      }
+    }
+  }
+
+  free(buffer);
+}
+
+void test_scan(void) {
+  _scan_find = _scan_find_word;
+  _scan_count = _scan_count_word;
+  _test_scan_kernel("word");
+
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2")) {
+    _scan_find = _scan_find_sse2;
+    _scan_count = _scan_count_sse2;
+    _test_scan_kernel("sse2");
+  } else {
+    printf("  sse2 not supported, skipped\n");
+  }
+
+  if (__builtin_cpu_supports("avx2")) {
+    _scan_find = _scan_find_avx2;
+    _scan_count = _scan_count_avx2;
+    _test_scan_kernel("avx2");
+  } else {
+    printf("  avx2 not supported, skipped\n");
+  }
+#endif
+
+  _scan_select();
+}
@@ -0,0 +1,312 @@
+#include "test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "clock.h"
+#include "ddhcp.h"
+#include "dhcp.h"
+#include "packet.h"
+#include "timer.h"
+
+// Internals of dhcp.c
+void _dhcp_lease_set_state(ddhcp_block* block, uint32_t lease_index, enum dhcp_lease_state state, ddhcp_config* config);
+
+#define TEST_TIMERS 64
+#define TEST_WHEEL_RANGE ((time_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct test_timer {
+  ddhcp_timer timer;
+  time_t expires;
+  time_t fired_at;
+  uint32_t fired;
+  uint8_t removed;
+};
+
+static struct test_timer timers[TEST_TIMERS];
+// The time the wheel runs at and the expiry of the last timer fired.
+static time_t now;
+static time_t last_fired;
+static int out_of_order;
+
+static void _test_timer_fire(ddhcp_timer* timer, ddhcp_config* config) {
+  (void) config;
+  struct test_timer* t = container_of(timer, struct test_timer, timer);
+
+  t->fired++;
+  t->fired_at = now;
+
+  if (t->expires < last_fired) {
+    out_of_order++;
+  }
+
+  last_fired = t->expires;
+}
+
+/**
+ * Schedule all timers relative to start: around the horizon of every
+ * level, beyond the range of the wheel, and at random.
+ */
+static void _test_timer_setup(ddhcp_timer_wheel* wheel, time_t start) {
+  time_t offsets[] = {
+    0, 1, 2, 63, 64, 65, 127, 128, 4095, 4096, 4097, 4160,
+    262143, 262144, 262145, TEST_WHEEL_RANGE - 1, TEST_WHEEL_RANGE, TEST_WHEEL_RANGE + 70,
+    2 * TEST_WHEEL_RANGE + 1, 64, 4096, 0,
+  };
+  size_t fixed = sizeof(offsets) / sizeof(offsets[0]);
+
+  timer_wheel_init(wheel, start);
+  now = start;
+  last_fired = 0;
+  out_of_order = 0;
+
+  for (int i = 0; i < TEST_TIMERS; i++) {
+    struct test_timer* t = timers + i;
+    t->expires = start + (i < (int) fixed ? offsets[i] : rand() % 300000);
+    t->fired = 0;
+    t->removed = 0;
+    timer_init(&t->timer, _test_timer_fire);
+    timer_add(wheel, &t->timer, t->expires);
+  }
+}
+
+static time_t _test_timer_earliest(void) {
+  time_t earliest = 0;
+
+  for (int i = 0; i < TEST_TIMERS; i++) {
+    if (!timers[i].fired && (earliest == 0 || timers[i].expires < earliest)) {
+      earliest = timers[i].expires;
+    }
+  }
+
+  return earliest;
+}
+
+void test_timer_wheel(void) {
+  ddhcp_timer_wheel wheel;
+  time_t start = TEST_CLOCK_START + 37;
+
+  // Follow timer_wheel_next like the event loop does, every timer has to
+  // fire exactly at its expiry.
+  _test_timer_setup(&wheel, start);
+
+  for (int rounds = 0; rounds < 100000; rounds++) {
+    time_t next = timer_wheel_next(&wheel);
+
+    if (next == 0) {
+      break;
+    }
+
+    if (!CHECK(next <= _test_timer_earliest())) {
+      break;
+    }
+
+    if (next > now) {
+      now = next;
+    }
+
+    timer_wheel_run(&wheel, now, NULL);
+  }
+
+  CHECK(wheel.count == 0);
+  CHECK(out_of_order == 0);
+
+  for (int i = 0; i < TEST_TIMERS; i++) {
+    CHECK(timers[i].fired == 1 && timers[i].fired_at == timers[i].expires);
+  }
+
+  // Steps of random length, timers fire within the step they expire in.
+  _test_timer_setup(&wheel, start);
+
+  // Rescheduled and removed timers.
+  timers[0].expires = start + 5000;
+  timer_add(&wheel, &timers[0].timer, timers[0].expires);
+  timers[1].removed = 1;
+  timer_del(&wheel, &timers[1].timer);
+  // Removing a timer twice is harmless.
+  timer_del(&wheel, &timers[1].timer);
+  CHECK(wheel.count == TEST_TIMERS - 1);
+
+  // The wheel did not run at start yet.
+  time_t ran = start - 1;
+
+  while (wheel.count > 0) {
+    now += 1 + rand() % (rand() % 2 ? 70 : 70000);
+    timer_wheel_run(&wheel, now, NULL);
+
+    for (int i = 0; i < TEST_TIMERS; i++) {
+      struct test_timer* t = timers + i;
+
+      if (t->removed) {
+        CHECK(t->fired == 0);
+        continue;
+      }
+
+      if (!CHECK(t->fired <= 1 && (t->expires > now) == (t->fired == 0))) {
+        return;
+      }
+
+      if (t->fired && t->fired_at == now) {
+        CHECK(t->expires > ran);
+      }
+    }
+
+    ran = now;
+  }
+
+  CHECK(out_of_order == 0);
+}
+
+void test_timeouts(void) {
+  ddhcp_config* config = test_config(24, 32);
+  time_t start = clock_now();
+
+  ddhcp_block* claimed = block_materialize(1, config);
+  block_set_state(claimed, DDHCP_CLAIMED, config);
+  block_set_timeout(claimed, start + 60, config);
+
+  ddhcp_block* ours = block_materialize(2, config);
+  block_own(ours, config);
+
+  // A lease offered in our block and one in a remote block.
+  dhcp_lease* offer = ours->addresses + 3;
+  _dhcp_lease_set_state(ours, 3, OFFERED, config);
+  dhcp_lease_set_end(offer, start + 12, config);
+  block_schedule_lease_timeout(ours, start + 12, config);
+
+  ddhcp_block* remote = block_materialize(3, config);
+  block_set_state(remote, DDHCP_CLAIMED, config);
+  block_set_timeout(remote, start + 600, config);
+  block_alloc(remote, config);
+  _dhcp_lease_set_state(remote, 0, OFFERED, config);
+  dhcp_lease_set_end(remote->addresses, start + 100, config);
+  block_schedule_lease_timeout(remote, start + 100, config);
+
+  // The wall clock stepping back or forth does not matter, only the
+  // synthetic daemon clock does.
+  clock_set(start + 12);
+  block_check_timeouts(config);
+  CHECK(ours->lease_states[3] == OFFERED);
+
+  clock_set(start + 13);
+  block_check_timeouts(config);
+  CHECK(ours->lease_states[3] == FREE);
+  CHECK(config->num_leases[OFFERED] == 0);
+
+  clock_set(start + 60);
+  block_check_timeouts(config);
+  CHECK(block_state(1, config) == DDHCP_CLAIMED);
+
+  clock_set(start + 61);
+  block_check_timeouts(config);
+  CHECK(block_state(1, config) == DDHCP_FREE);
+
+  // A remote block is released with its last lease.
+  clock_set(start + 100);
+  block_check_timeouts(config);
+  CHECK(block_state(3, config) == DDHCP_CLAIMED && remote->addresses != NULL);
+
+  clock_set(start + 101);
+  block_check_timeouts(config);
+  CHECK(block_state(3, config) == DDHCP_FREE);
+
+  // Our block does not time out by itself.
+  clock_set(start + 100000);
+  block_check_timeouts(config);
+  CHECK(block_state(2, config) == DDHCP_OURS);
+
+  test_config_free(config);
+}
+
+/**
+ * Run the event loop on the synthetic clock until end, waking up for timers
+ * and claim epochs or after at most step seconds. Returns 0 as soon as one
+ * of our blocks is lost.
+ */
+static int _test_claims_run(time_t end, time_t step, uint32_t ours, ddhcp_config* config) {
+  while (clock_now() < end) {
+    time_t next = clock_now() + 1 + rand() % step;
+    time_t due = timer_wheel_next(&config->timers);
+
+    if (due != 0 && due < next) {
+      next = due;
+    }
+
+    if (block_next_update(config) != 0 && block_next_update(config) < next) {
+      next = block_next_update(config);
+    }
+
+    clock_set(next > clock_now() ? next : clock_now() + 1);
+    block_check_timeouts(config);
+    block_update_claims(0, config);
+    config->mcast_queue.count = config->mcast_queue.first = 0;
+
+    ddhcp_block* block;
+
+    list_for_each_entry(block, &config->block_lists[DDHCP_OURS], list) {
+      if (!CHECK(BLOCK_TIMEOUT(block) > clock_now())) {
+        return 0;
+      }
+    }
+
+    if (!CHECK(config->num_blocks[DDHCP_OURS] == ours)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void test_claim_epochs(void) {
+  ddhcp_config* config = test_config(24, 8);
+  ddhcp_node_id other = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+  ddhcp_payload inquired;
+  ddhcp_mcast_packet inquire = {
+    .command = DDHCP_MSG_INQUIRE,
+    .count = 1,
+    .payload = &inquired,
+  };
+  time_t period = config->block_timeout / (config->block_refresh_factor + 1);
+  uint32_t ours = 0;
+
+  memcpy(inquire.node_id, other, sizeof(ddhcp_node_id));
+
+  for (uint32_t index = 0; index < 4; index++) {
+    block_own(block_materialize(index, config), config);
+    ours++;
+  }
+
+  // Blocks owned in between are folded into the next epoch.
+  CHECK(_test_claims_run(clock_now() + 3 * period, 5, ours, config));
+
+  for (uint32_t index = 4; index < 8; index++) {
+    clock_set(clock_now() + 1 + rand() % 7);
+    block_own(block_materialize(index, config), config);
+    ours++;
+    CHECK(_test_claims_run(clock_now() + 1, 1, ours, config));
+  }
+
+  uint64_t epochs = config->claim_epochs;
+  uint64_t messages = config->block_messages.messages;
+  CHECK(_test_claims_run(clock_now() + 20 * period, 5, ours, config));
+
+  // One message per epoch, all blocks together.
+  CHECK(config->claim_epochs - epochs >= 19 && config->claim_epochs - epochs <= 21);
+  CHECK(config->block_messages.messages - messages == config->claim_epochs - epochs);
+
+  // Inquiries of our blocks force an update out of turn, which must not
+  // push any block past its timeout either.
+  for (int round = 0; round < 50; round++) {
+    inquired.block_index = rand() % ours;
+    ddhcp_block_process_inquire(&inquire, config);
+    CHECK(block_state(inquired.block_index, config) == DDHCP_OURS);
+
+    if (!CHECK(_test_claims_run(clock_now() + 1 + rand() % (2 * period), 7, ours, config))) {
+      break;
+    }
+  }
+
+  CHECK(config->claim_updates_between > 0);
+  test_config_free(config);
+}
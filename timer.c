@@ -0,0 +1,170 @@
+#include "timer.h"
+#include "logger.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_RANGE ((time_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+void timer_wheel_init(ddhcp_timer_wheel* wheel, time_t now) {
+  wheel->next = now;
+  wheel->count = 0;
+  INIT_LIST_HEAD(&wheel->due);
+
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SIZE; slot++) {
+      INIT_LIST_HEAD(&wheel->slots[level][slot]);
+    }
+  }
+}
+
+void timer_init(ddhcp_timer* timer, void (*fire)(ddhcp_timer* timer, ddhcp_config* config)) {
+  INIT_LIST_HEAD(&timer->list);
+  timer->expires = 0;
+  timer->fire = fire;
+}
+
+void _timer_enqueue(ddhcp_timer_wheel* wheel, ddhcp_timer* timer) {
+  time_t expires = timer->expires;
+  time_t delta = expires - wheel->next;
+
+  if (delta < 0) {
+    list_add_tail(&timer->list, &wheel->due);
+    return;
+  }
+
+  // Timers beyond the range of the wheel wait in the last slot reachable
+  // and are enqueued again when they get cascaded.
+  if (delta >= TIMER_WHEEL_RANGE) {
+    expires = wheel->next + TIMER_WHEEL_RANGE - 1;
+    delta = TIMER_WHEEL_RANGE - 1;
+  }
+
+  int level = 0;
+
+  while (delta >= (time_t) 1 << (TIMER_WHEEL_BITS * (level + 1))) {
+    level++;
+  }
+
+  int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  list_add_tail(&timer->list, &wheel->slots[level][slot]);
+}
+
+void timer_add(ddhcp_timer_wheel* wheel, ddhcp_timer* timer, time_t expires) {
+  if (timer_pending(timer)) {
+    list_del_init(&timer->list);
+  } else {
+    wheel->count++;
+  }
+
+  timer->expires = expires;
+  _timer_enqueue(wheel, timer);
+}
+
+void timer_del(ddhcp_timer_wheel* wheel, ddhcp_timer* timer) {
+  if (timer_pending(timer)) {
+    list_del_init(&timer->list);
+    wheel->count--;
+  }
+}
+
+/**
+ * Move all timers of a slot into the lower levels.
+ * Returns the index of the cascaded slot.
+ */
+int _timer_cascade(ddhcp_timer_wheel* wheel, int level) {
+  int slot = (wheel->next >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+  struct list_head pending;
+
+  INIT_LIST_HEAD(&pending);
+  list_splice_init(&wheel->slots[level][slot], &pending);
+
+  while (!list_empty(&pending)) {
+    ddhcp_timer* timer = list_first_entry(&pending, ddhcp_timer, list);
+    list_del_init(&timer->list);
+    _timer_enqueue(wheel, timer);
+  }
+
+  return slot;
+}
+
+void _timer_fire_list(ddhcp_timer_wheel* wheel, struct list_head* expired, ddhcp_config* config) {
+  while (!list_empty(expired)) {
+    ddhcp_timer* timer = list_first_entry(expired, ddhcp_timer, list);
+    list_del_init(&timer->list);
+    wheel->count--;
+    timer->fire(timer, config);
+  }
+}
+
+time_t timer_wheel_next(ddhcp_timer_wheel* wheel) {
+  if (wheel->count == 0) {
+    return 0;
+  }
+
+  if (!list_empty(&wheel->due)) {
+    return wheel->next - 1;
+  }
+
+  time_t next = 0;
+
+  // The first level holds exactly the timers of the next TIMER_WHEEL_SIZE seconds.
+  for (int i = 0; i < TIMER_WHEEL_SIZE; i++) {
+    if (!list_empty(&wheel->slots[0][(wheel->next + i) & TIMER_WHEEL_MASK])) {
+      next = wheel->next + i;
+      break;
+    }
+  }
+
+  // Timers of higher levels expire no earlier than their slot gets cascaded,
+  // the slot of the current round is still pending at its very beginning.
+  for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    time_t start = wheel->next >> (TIMER_WHEEL_BITS * level);
+    int first = (start << (TIMER_WHEEL_BITS * level)) == wheel->next ? 0 : 1;
+
+    for (int i = first; i <= TIMER_WHEEL_SIZE; i++) {
+      time_t cascade = (start + i) << (TIMER_WHEEL_BITS * level);
+
+      if (next != 0 && cascade >= next) {
+        break;
+      }
+
+      if (!list_empty(&wheel->slots[level][(start + i) & TIMER_WHEEL_MASK])) {
+        next = cascade;
+        break;
+      }
+    }
+  }
+
+  return next;
+}
+
+void timer_wheel_run(ddhcp_timer_wheel* wheel, time_t now, ddhcp_config* config) {
+  DEBUG("timer_wheel_run(wheel, %li, config) with %u timers\n", (long) now, wheel->count);
+  struct list_head expired;
+  INIT_LIST_HEAD(&expired);
+
+  while (wheel->next <= now) {
+    if (wheel->count == 0) {
+      wheel->next = now + 1;
+      break;
+    }
+
+    // Cascade the next level whenever a level completes a round.
+    if ((wheel->next & TIMER_WHEEL_MASK) == 0) {
+      for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (_timer_cascade(wheel, level) != 0) {
+          break;
+        }
+      }
+    }
+
+    list_splice_tail_init(&wheel->slots[0][wheel->next & TIMER_WHEEL_MASK], &expired);
+    wheel->next++;
+    _timer_fire_list(wheel, &expired, config);
+  }
+
+  // Timers added while firing others may already be due.
+  while (!list_empty(&wheel->due)) {
+    list_splice_tail_init(&wheel->due, &expired);
+    _timer_fire_list(wheel, &expired, config);
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include "types.h"
+
+/**
+ * A hierarchical timer wheel with a resolution of one second.
+ *
+ * Timers are kept in TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SIZE slots,
+ * each level covering TIMER_WHEEL_SIZE times the range of the level below.
+ * Timers of a higher level are cascaded into the lower levels when their slot
+ * is reached, so running the wheel only touches timers which actually expire.
+ */
+
+/**
+ * Initialize an empty timer wheel starting at now.
+ */
+void timer_wheel_init(ddhcp_timer_wheel* wheel, time_t now);
+
+/**
+ * Initialize a timer with the function called when it expires.
+ */
+void timer_init(ddhcp_timer* timer, void (*fire)(ddhcp_timer* timer, ddhcp_config* config));
+
+/**
+ * (Re)schedule a timer to fire at expires.
+ * A timer which already expired fires on the next run of the wheel.
+ */
+void timer_add(ddhcp_timer_wheel* wheel, ddhcp_timer* timer, time_t expires);
+
+/**
+ * Remove a timer from the wheel, if it is pending.
+ */
+void timer_del(ddhcp_timer_wheel* wheel, ddhcp_timer* timer);
+
+/**
+ * Is the timer scheduled.
+ */
+#define timer_pending(timer) (!list_empty(&(timer)->list))
+
+/**
+ * Return the earliest point in time a timer may expire, or 0 if the wheel
+ * is empty. For timers in the higher levels this is the time their slot gets
+ * cascaded, running the wheel then yields a closer bound.
+ */
+time_t timer_wheel_next(ddhcp_timer_wheel* wheel);
+
+/**
+ * Fire all timers which expired until now.
+ */
+void timer_wheel_run(ddhcp_timer_wheel* wheel, time_t now, ddhcp_config* config);
+
+#endif
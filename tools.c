@@ -72,10 +72,9 @@ char* hwaddr2c(uint8_t* hwaddr) {
   char* istr = str;
 
   for (int i = 0; i < 6; i++) {
-    sprintf(istr, "%02X:", (char) hwaddr[i]);
-    istr = istr + 2;
+    sprintf(istr, i < 5 ? "%02X:" : "%02X", hwaddr[i]);
+    istr = istr + 3;
   }
 
-  str[32] = '\0';
   return str;
 }
@@ -2,6 +2,8 @@
 #define _TYPES_H
 
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
 #include <time.h>
 
 #include "list.h"
@@ -9,6 +11,31 @@
 
 #define NODE_ID_CMP(id1,id2) memcmp((char*) (id1), (char*) (id2), sizeof(ddhcp_node_id))
 
+struct ddhcp_config;
+
+// timer structures
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+struct ddhcp_timer {
+  struct list_head list;
+  time_t expires;
+  void (*fire)(struct ddhcp_timer* timer, struct ddhcp_config* config);
+};
+typedef struct ddhcp_timer ddhcp_timer;
+
+struct ddhcp_timer_wheel {
+  // The next second which has not been processed yet.
+  time_t next;
+  uint32_t count;
+  // Timers which expired before they got added.
+  struct list_head due;
+  struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+};
+typedef struct ddhcp_timer_wheel ddhcp_timer_wheel;
+
 // node ident
 
 typedef uint8_t ddhcp_node_id[8];
@@ -25,43 +52,211 @@ enum ddhcp_block_state {
   DDHCP_OURS,
   DDHCP_BLOCKED
 };
+#define DDHCP_BLOCK_STATES (DDHCP_BLOCKED + 1)
 
+enum dhcp_lease_state {
+  FREE,
+  OFFERED,
+  LEASED,
+};
+#define DHCP_LEASE_STATES (LEASED + 1)
+
+// The state and timeout of a block are kept in the dense arrays of its
+// page, use BLOCK_STATE and BLOCK_TIMEOUT to access them.
 struct ddhcp_block {
   uint32_t index;
-  enum ddhcp_block_state state;
   struct in_addr subnet;
   uint8_t  subnet_len;
   uint8_t claiming_counts;
   ddhcp_node_id node_id;
   struct in6_addr owner_address;
-  time_t timeout;
   // Only iff state is equal to CLAIMED lease_block is not equal to NULL.
   struct dhcp_lease* addresses;
+  // States of the leases and bitmaps of FREE and OFFERED leases, all
+  // allocated together with addresses.
+  uint8_t* lease_states;
+  uint64_t* lease_free;
+  uint64_t* lease_offered;
+  // Number of leases per state, all zero while addresses is NULL.
+  uint32_t num_leases[DHCP_LEASE_STATES];
+  // Fires when timeout has passed.
+  ddhcp_timer timer;
+  // Fires when the earliest lease_end of the addresses has passed.
+  ddhcp_timer lease_timer;
+  // Entry in the list of blocks sharing the same state, unused while FREE.
+  struct list_head list;
 };
 typedef struct ddhcp_block ddhcp_block;
 
-struct ddhcp_block_list {
-  struct ddhcp_block* block;
-  struct list_head list;
+// Blocks are materialized in pages, only pages holding a non FREE block
+// need to stay allocated.
+#define BLOCK_PAGE_BITS 6
+#define BLOCK_PAGE_SIZE (1 << BLOCK_PAGE_BITS)
+
+struct ddhcp_block_page {
+  // Number of blocks in this page which are not FREE.
+  uint32_t active;
+  // Entry in the list of pages without active blocks.
+  struct list_head idle;
+  // Hot data, scanned without touching the blocks themselves.
+  uint8_t states[BLOCK_PAGE_SIZE];
+  time_t timeouts[BLOCK_PAGE_SIZE];
+  // Cold data.
+  ddhcp_block blocks[BLOCK_PAGE_SIZE];
 };
-typedef struct ddhcp_block_list ddhcp_block_list;
+typedef struct ddhcp_block_page ddhcp_block_page;
+
+#define BLOCK_PAGE_OFFSET(index) ((index) & (BLOCK_PAGE_SIZE - 1))
+#define BLOCK_PAGE(block) container_of((block) - BLOCK_PAGE_OFFSET((block)->index), ddhcp_block_page, blocks[0])
+#define BLOCK_STATE(block) (BLOCK_PAGE(block)->states[BLOCK_PAGE_OFFSET((block)->index)])
+#define BLOCK_TIMEOUT(block) (BLOCK_PAGE(block)->timeouts[BLOCK_PAGE_OFFSET((block)->index)])
 
 // DHCP structures
 
-enum dhcp_lease_state {
-  FREE,
-  OFFERED,
-  LEASED,
-};
+#define DHCP_LEASE_WORDS(leases) (((uint32_t) (leases) + 63) / 64)
 
+// Only ethernet clients are served, leases record their 6 byte hardware
+// address. Requests with another htype or hlen are dropped by dhcp_process.
+#define DHCP_HWADDR_LEN 6
+#define HWADDR_CMP(a,b) memcmp(a,b,DHCP_HWADDR_LEN)
+#define HWADDR_CP(dest,src) memcpy(dest,src,DHCP_HWADDR_LEN)
+#define HWADDR_CLEAR(addr) memset(addr,'\0',DHCP_HWADDR_LEN)
+
+// A lease packs into 16 bytes, its state is kept in the lease_states array
+// of its block and lease_end counts seconds since the epoch of the daemon,
+// use dhcp_lease_end and dhcp_lease_set_end to convert it.
 struct dhcp_lease {
-  uint8_t chaddr[16];
-  enum dhcp_lease_state state;
+  uint8_t hwaddr[DHCP_HWADDR_LEN];
   uint32_t xid;
-  time_t lease_end;
+  uint32_t lease_end;
 };
 typedef struct dhcp_lease dhcp_lease;
 
+// Fixed size allocator, see slab.h.
+struct ddhcp_slab {
+  size_t chunk_size;
+  // Preallocated chunks.
+  uint8_t* chunks;
+  uint32_t slab_chunks;
+  // Released chunks, linked through their first bytes.
+  void* free;
+  uint32_t num_free;
+  // Released heap chunks in the free list and their maximum.
+  uint32_t num_cached;
+  uint32_t cache_limit;
+  // Statistics
+  uint32_t in_use;
+  uint64_t allocs;
+  uint64_t releases;
+  uint64_t heap_allocs;
+  uint64_t heap_frees;
+};
+typedef struct ddhcp_slab ddhcp_slab;
+
+// Batched receive, see batch.h.
+#define BATCH_SIZE 32
+#define BATCH_BUFFER_LEN 1500
+
+struct ddhcp_batch_stats {
+  // Calls of batch_recv which returned datagrams.
+  uint64_t batches;
+  uint64_t packets;
+  // Batches which filled all slots.
+  uint64_t full;
+  uint32_t largest;
+};
+typedef struct ddhcp_batch_stats ddhcp_batch_stats;
+
+// Nodes heard of on the multicast group.
+#define DDHCP_PEERS 64
+
+// Pacing of the block entries we inquire, per second and at most at once.
+#define DDHCP_INQUIRE_RATE 64
+#define DDHCP_INQUIRE_BURST 256
+
+// Claim rounds back off up to 2^DDHCP_CLAIM_BACKOFF_MAX claim intervals.
+#define DDHCP_CLAIM_BACKOFF_MAX 6
+
+// Blocks recently lost to another node, skipped when picking new blocks.
+#define DDHCP_CONTESTED 16
+
+struct ddhcp_contested {
+  uint32_t index;
+  time_t until;
+};
+typedef struct ddhcp_contested ddhcp_contested;
+
+struct ddhcp_peer {
+  ddhcp_node_id node_id;
+  time_t last_seen;
+  uint8_t capable;
+};
+typedef struct ddhcp_peer ddhcp_peer;
+
+// Block messages (UPDATECLAIM, INQUIRE) and the datagrams they were split into.
+struct ddhcp_message_stats {
+  uint64_t messages;
+  uint64_t datagrams;
+  uint64_t entries;
+  uint64_t bytes;
+  uint64_t ranges;
+  // Received claims of more than DDHCP_CLAIM_MAX_BLOCKS blocks, dropped.
+  uint64_t oversized;
+  uint32_t largest;
+};
+typedef struct ddhcp_message_stats ddhcp_message_stats;
+
+struct ddhcp_recv_batch {
+  struct mmsghdr msgs[BATCH_SIZE];
+  struct iovec iovecs[BATCH_SIZE];
+  struct sockaddr_in6 addrs[BATCH_SIZE];
+  uint8_t* buffers;
+};
+typedef struct ddhcp_recv_batch ddhcp_recv_batch;
+
+// Outbound datagrams of a socket, see batch.h.
+#define SEND_QUEUE_SIZE 64
+#define SEND_BUFFER_LEN 2048
+
+struct ddhcp_send_queue {
+  int socket;
+  // Entries from first up to count wait to be sent.
+  uint32_t first;
+  uint32_t count;
+  // Set while the socket buffer is full.
+  uint8_t blocked;
+  struct mmsghdr msgs[SEND_QUEUE_SIZE];
+  struct iovec iovecs[SEND_QUEUE_SIZE];
+  struct sockaddr_storage addrs[SEND_QUEUE_SIZE];
+  uint8_t* buffers;
+  // Statistics
+  uint64_t queued;
+  uint64_t sent;
+  uint64_t dropped;
+  uint64_t calls;
+  uint64_t stalls;
+};
+typedef struct ddhcp_send_queue ddhcp_send_queue;
+
+// Client table, an open addressing hash of clients with a lease in one of
+// our blocks, keyed by hardware address.
+struct ddhcp_client {
+  uint8_t hwaddr[DHCP_HWADDR_LEN];
+  uint8_t used;
+  // Offset of the lease in our prefix, block index * block size + lease index.
+  uint32_t offset;
+};
+typedef struct ddhcp_client ddhcp_client;
+
+struct ddhcp_client_table {
+  ddhcp_client* clients;
+  uint32_t size;
+  uint32_t count;
+  // Clients which could not be registered for lack of memory.
+  uint32_t unindexed;
+};
+typedef struct ddhcp_client_table ddhcp_client_table;
+
 struct dhcp_option {
   uint8_t code;
   uint8_t len;
@@ -69,11 +264,44 @@ struct dhcp_option {
 };
 typedef struct dhcp_option dhcp_option;
 
-struct dhcp_option_list {
-  struct dhcp_option* option;
-  struct list_head list;
+// Options indexed by code, the payload of each option points into its
+// wire encoding (code, len, payload) which replies copy as a whole.
+struct dhcp_option_store {
+  struct dhcp_option* options[256];
+  uint8_t* encoded[256];
+  // Sum of the length of all encoded options.
+  uint32_t encoded_len;
+  // Incremented on every change of the store.
+  uint32_t generation;
+  // Address lease time in host byte order, zero if not set.
+  uint32_t lease_time;
+};
+typedef struct dhcp_option_store dhcp_option_store;
+
+// Serialized reply to a request with a given message type and parameter
+// request list, valid for a generation of the option store.
+#define DHCP_REPLY_TEMPLATES 16
+
+struct dhcp_reply_template {
+  uint8_t msg_type;
+  uint8_t prl_len;
+  uint8_t prl[255];
+  uint32_t generation;
+  // Length of image, zero while the template is unused.
+  uint16_t len;
+  uint8_t image[DHCP_PACKET_MAX_LEN];
 };
-typedef struct dhcp_option_list dhcp_option_list;
+typedef struct dhcp_reply_template dhcp_reply_template;
+
+// Relay agents we serve requests from, identified by giaddr.
+#define DHCP_RELAYS 16
+
+struct dhcp_relay {
+  struct in_addr address;
+  uint64_t requests;
+  uint64_t replies;
+};
+typedef struct dhcp_relay dhcp_relay;
 
 enum dhcp_option_code {
   // RFC 2132
@@ -107,25 +335,90 @@ struct ddhcp_config {
   uint8_t disable_dhcp;
 
   // Global Stuff
+  // Next point in time on the daemon clock house keeping is due, 0 while
+  // nothing is scheduled.
   time_t next_wakeup;
-  uint32_t loop_timeout;
-  unsigned int claiming_blocks_amount;
-  ddhcp_block* blocks;
-  ddhcp_block_list claiming_blocks;
+  ddhcp_timer_wheel timers;
+  // Seconds between two claim rounds and the next round, 0 if none is running.
+  uint32_t claim_interval;
+  time_t next_claim_round;
+  // Next refresh of all our claims, 0 while we own no block.
+  time_t claim_epoch;
+  uint64_t claim_epochs;
+  uint64_t claim_updates_between;
+  // No new blocks are picked before claim_backoff_until after a collision.
+  uint8_t claim_backoff;
+  time_t claim_backoff_until;
+  uint32_t inquire_tokens;
+  time_t inquire_tokens_at;
+  uint64_t collisions_lost;
+  uint64_t collisions_won;
+  uint64_t inquires_paced;
+  ddhcp_contested contested[DDHCP_CONTESTED];
+  uint32_t contested_next;
+  uint64_t contested_skips;
+  uint64_t wakeups;
+  uint64_t house_keeping_runs;
+  ddhcp_block_page** block_pages;
+  uint32_t number_of_pages;
+  struct list_head idle_block_pages;
+  // Lists and number of blocks per state, the list of FREE blocks is kept empty.
+  struct list_head block_lists[DDHCP_BLOCK_STATES];
+  uint32_t num_blocks[DDHCP_BLOCK_STATES];
+  // Number of leases per state in OUR blocks.
+  uint32_t num_leases[DHCP_LEASE_STATES];
+
+  // Index of free blocks: one bit per block marks it as not free, a fenwick
+  // tree over the words of that bitmap allows rank and select in O(log n).
+  uint64_t* block_used;
+  uint32_t* block_used_tree;
+  uint32_t block_used_words;
+  uint32_t num_free_blocks;
 
   // DHCP packets for later use.
   struct dhcp_packet_list dhcp_packet_cache;
 
+  // Clients with a lease in one of our blocks.
+  ddhcp_client_table clients;
+  // Lease times are stored relative to this point in time.
+  time_t epoch;
+  // Storage for the leases of blocks.
+  ddhcp_slab lease_slab;
+
   // DHCP Options
-  dhcp_option_list options;
+  dhcp_option_store options;
+  dhcp_reply_template reply_templates[DHCP_REPLY_TEMPLATES];
+  uint64_t reply_template_hits;
+  uint64_t reply_template_misses;
+  uint64_t unicast_replies;
+  uint64_t broadcast_replies;
+  uint64_t non_ethernet_requests;
+  dhcp_relay relays[DHCP_RELAYS];
+  uint32_t relays_len;
+  uint64_t relay_untracked;
+  // Requests from relay agents outside of our prefix.
+  uint64_t relay_rejected;
 
   // Network
+  ddhcp_recv_batch recv_batch;
+  ddhcp_batch_stats mcast_recv;
+  ddhcp_batch_stats server_recv;
+  ddhcp_batch_stats client_recv;
+  ddhcp_send_queue mcast_queue;
+  ddhcp_send_queue server_queue;
+  ddhcp_send_queue client_queue;
   int mcast_socket;
   int server_socket;
   int client_socket;
   uint32_t mcast_scope_id;
+  uint32_t mcast_mtu;
+  ddhcp_message_stats block_messages;
+  ddhcp_peer peers[DDHCP_PEERS];
+  uint32_t peers_len;
+  time_t peers_overflow;
   uint32_t server_scope_id;
   uint32_t client_scope_id;
+  char client_interface[IFNAMSIZ];
 
   // Control
   int control_socket;
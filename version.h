@@ -0,0 +1 @@
+#define REVISION "2918501f5878f24dbec48c04cc5d6962e1a9e980"